@@ -0,0 +1,191 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Арена (bump-аллокатор) задачи: память выдаётся подряд из больших блоков и не освобождается поштучно.
+ *
+ * Ключи и узлы хеш-таблиц задачи живут в арене, поэтому на запись не приходится ни одного malloc.
+ * reset() возвращает арену в начало, но блоки сохраняет - следующая серия задачи пишет в ту же память.
+ * Память освобождается целиком вместе с ареной.
+ */
+class Arena
+{
+public:
+    
+    static constexpr size_t DEFAULT_BLOCK_SIZE = 1 << 20;
+    
+    explicit Arena( size_t block_size = DEFAULT_BLOCK_SIZE )
+    : block_size( block_size )
+    {}
+    
+    Arena( const Arena& ) = delete;
+    Arena& operator=( const Arena& ) = delete;
+    
+    void* allocate( size_t size, size_t alignment = alignof( std::max_align_t ) )
+    {
+        for( ;; )
+        {
+            if( current < blocks.size() )
+            {
+                size_t aligned = ( pos + alignment - 1 ) & ~( alignment - 1 );
+                if( aligned + size <= blocks[ current ].size )
+                {
+                    pos = aligned + size;
+                    used += size;
+                    return blocks[ current ].data.get() + aligned;
+                }
+                
+                if( current + 1 < blocks.size() )
+                {
+                    ++current;
+                    pos = 0;
+                    continue;
+                }
+            }
+            
+            // блоки выделяются с запасом на выравнивание, поэтому новый блок точно вместит запрос
+            size_t new_size = std::max( block_size, size + alignment );
+            blocks.push_back( Block{ std::make_unique< char[] >( new_size ), new_size } );
+            held += new_size;
+            current = blocks.size() - 1;
+            pos = 0;
+        }
+    }
+    
+    // копия строки в арене
+    std::string_view store( std::string_view s )
+    {
+        char* data = static_cast< char* >( allocate( s.size(), 1 ) );
+        if( !s.empty() )
+            std::memcpy( data, s.data(), s.size() );
+        return std::string_view( data, s.size() );
+    }
+    
+    // всё выданное становится недействительным; блоки остаются за ареной
+    void reset()
+    {
+        current = 0;
+        pos = 0;
+        used = 0;
+    }
+    
+    // сколько байт выдано после последнего reset()
+    size_t bytes_used() const
+    {
+        return used;
+    }
+    
+    // сколько памяти занимают блоки арены
+    size_t capacity() const
+    {
+        return held;
+    }
+    
+private:
+    struct Block
+    {
+        std::unique_ptr< char[] > data;
+        size_t size;
+    };
+    
+    std::vector< Block > blocks;
+    size_t block_size;
+    size_t current = 0;
+    size_t pos = 0;
+    size_t used = 0;
+    size_t held = 0;
+};
+
+/**
+ * Аллокатор для контейнеров STL поверх арены: deallocate ничего не делает.
+ * Контейнер должен быть уничтожен до reset() своей арены.
+ */
+template< typename T >
+class ArenaAllocator
+{
+public:
+    
+    using value_type = T;
+    
+    explicit ArenaAllocator( Arena* arena )
+    : arena( arena )
+    {}
+    
+    template< typename U >
+    ArenaAllocator( const ArenaAllocator< U >& other )
+    : arena( other.arena )
+    {}
+    
+    T* allocate( size_t n )
+    {
+        return static_cast< T* >( arena->allocate( n * sizeof( T ), alignof( T ) ) );
+    }
+    
+    void deallocate( T*, size_t )
+    {
+    }
+    
+    template< typename U >
+    bool operator==( const ArenaAllocator< U >& other ) const
+    {
+        return arena == other.arena;
+    }
+    
+    template< typename U >
+    bool operator!=( const ArenaAllocator< U >& other ) const
+    {
+        return arena != other.arena;
+    }
+    
+private:
+    template< typename U >
+    friend class ArenaAllocator;
+    
+    Arena* arena;
+};
+
+/**
+ * Как ключ хранится в арене: строки - string_view на копию в арене, остальные типы - по значению.
+ *     View  - тип хранимого ключа
+ *     view  - ключ любого совместимого типа как View, без копирования строки
+ *     store - постоянная копия в арене
+ */
+template< typename Key >
+struct ArenaKey
+{
+    using View = Key;
+    
+    template< typename K >
+    static View view( const K& key )
+    {
+        return Key( key );
+    }
+    
+    static View store( Arena&, const View& key )
+    {
+        return key;
+    }
+};
+
+template<>
+struct ArenaKey< std::string >
+{
+    using View = std::string_view;
+    
+    static View view( std::string_view key )
+    {
+        return key;
+    }
+    
+    static View store( Arena& arena, std::string_view key )
+    {
+        return arena.store( key );
+    }
+};
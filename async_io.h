@@ -0,0 +1,610 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#if defined( __linux__ ) && defined( __has_include )
+#if __has_include( <linux/io_uring.h> )
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#define MAPREDUCE_HAS_IO_URING 1
+#endif
+#endif
+
+#include "thread_pool.h"
+
+/**
+ * Асинхронный ввод-вывод для файлов промежуточных данных.
+ *
+ * У каждого файла не больше одной операции в полёте: читатель заранее читает следующий кусок,
+ * пока разбирается текущий (ReadAhead), писатель отдаёт заполненный буфер на запись и сразу
+ * заполняет второй (OutputSink). Так диск и процессор заняты одновременно.
+ *
+ * Бэкенды:
+ *     IoUring - io_uring на Linux (системные вызовы напрямую, без liburing), одно кольцо на поток
+ *               для всех его файлов: k-путевое слияние сотен серий не упирается в RLIMIT_MEMLOCK;
+ *     Threads - pread/pwrite в отдельном пуле потоков ввода-вывода;
+ *     Sync    - обычные блокирующие вызовы.
+ * По умолчанию io_uring, если ядро его поддерживает, иначе потоки; не создалось кольцо потока - тоже потоки.
+ * Переменная окружения MAPREDUCE_IO=uring|threads|sync выбирает бэкенд явно.
+ */
+namespace async_io
+{
+    enum class Backend
+    {
+        Sync,
+        Threads,
+        IoUring
+    };
+    
+    static constexpr size_t IO_THREADS = 2;
+    
+    inline ThreadPool& io_threads()
+    {
+        static ThreadPool pool( IO_THREADS );
+        return pool;
+    }
+
+#ifdef MAPREDUCE_HAS_IO_URING
+    /**
+     * Минимальное кольцо io_uring, общее для нескольких файлов. Операция помечается номером,
+     * и wait( номер ) ждёт именно её: чужие завершения откладываются до вызова их владельцем.
+     * В ядре одновременно не больше операций, чем вмещает очередь завершений, - лишняя ждёт места.
+     * Завершения из кольца забирает один поток за раз, остальные ждут его на условной переменной.
+     * Кольцо можно звать из нескольких потоков.
+     */
+    class Ring
+    {
+    public:
+    
+        static constexpr unsigned ENTRIES = 64;
+    
+        Ring()
+        : owner( ::getpid() )
+        {
+            io_uring_params params;
+            std::memset( &params, 0, sizeof( params ) );
+            
+            int fd = static_cast< int >( ::syscall( __NR_io_uring_setup, ENTRIES, &params ) );
+            if( fd < 0 )
+                return;
+            ring_fd = fd;
+            capacity = params.cq_entries;
+            
+            sq_size = params.sq_off.array + params.sq_entries * sizeof( unsigned );
+            cq_size = params.cq_off.cqes + params.cq_entries * sizeof( io_uring_cqe );
+            if( params.features & IORING_FEAT_SINGLE_MMAP )
+                sq_size = cq_size = std::max( sq_size, cq_size );
+            
+            sq_ptr = ::mmap( nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING );
+            if( sq_ptr == MAP_FAILED )
+            {
+                close_ring();
+                return;
+            }
+            
+            if( params.features & IORING_FEAT_SINGLE_MMAP )
+            {
+                cq_ptr = sq_ptr;
+            }
+            else
+            {
+                cq_ptr = ::mmap( nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING );
+                if( cq_ptr == MAP_FAILED )
+                {
+                    close_ring();
+                    return;
+                }
+            }
+            
+            sqes_size = params.sq_entries * sizeof( io_uring_sqe );
+            void* sqes_ptr = ::mmap( nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES );
+            if( sqes_ptr == MAP_FAILED )
+            {
+                close_ring();
+                return;
+            }
+            sqes = static_cast< io_uring_sqe* >( sqes_ptr );
+            
+            char* sq = static_cast< char* >( sq_ptr );
+            sq_tail = reinterpret_cast< unsigned* >( sq + params.sq_off.tail );
+            sq_mask = *reinterpret_cast< unsigned* >( sq + params.sq_off.ring_mask );
+            sq_array = reinterpret_cast< unsigned* >( sq + params.sq_off.array );
+            
+            char* cq = static_cast< char* >( cq_ptr );
+            cq_head = reinterpret_cast< unsigned* >( cq + params.cq_off.head );
+            cq_tail = reinterpret_cast< unsigned* >( cq + params.cq_off.tail );
+            cq_mask = *reinterpret_cast< unsigned* >( cq + params.cq_off.ring_mask );
+            cqes = reinterpret_cast< io_uring_cqe* >( cq + params.cq_off.cqes );
+        }
+        
+        ~Ring()
+        {
+            close_ring();
+        }
+        
+        Ring( const Ring& ) = delete;
+        Ring& operator=( const Ring& ) = delete;
+        
+        bool valid() const
+        {
+            return sqes != nullptr;
+        }
+        
+        // процесс, создавший кольцо: после fork() потомку нужно своё
+        pid_t owner_pid() const
+        {
+            return owner;
+        }
+        
+        // номер операции для wait(); 0 - ядро не приняло операцию, её надо выполнить иначе
+        uint64_t submit( uint8_t opcode, int fd, const void* buffer, size_t size, uint64_t offset )
+        {
+            std::unique_lock< std::mutex > lock( mutex );
+            while( in_kernel >= capacity )
+            {
+                if( poll( lock ) < 0 )
+                    return 0;
+            }
+            
+            uint64_t id = next_id++;
+            unsigned tail = *sq_tail;
+            unsigned index = tail & sq_mask;
+            
+            io_uring_sqe& sqe = sqes[ index ];
+            std::memset( &sqe, 0, sizeof( sqe ) );
+            sqe.opcode = opcode;
+            sqe.fd = fd;
+            sqe.addr = reinterpret_cast< uint64_t >( buffer );
+            sqe.len = static_cast< uint32_t >( size );
+            sqe.off = offset;
+            sqe.user_data = id;
+            
+            sq_array[ index ] = index;
+            __atomic_store_n( sq_tail, tail + 1, __ATOMIC_RELEASE );
+            
+            for( ;; )
+            {
+                int submitted = static_cast< int >( ::syscall( __NR_io_uring_enter, ring_fd, 1, 0, 0, nullptr, 0 ) );
+                if( submitted == 1 )
+                {
+                    ++in_kernel;
+                    return id;
+                }
+                if( submitted < 0 && errno == EINTR )
+                    continue;
+                
+                __atomic_store_n( sq_tail, tail, __ATOMIC_RELEASE );
+                return 0;
+            }
+        }
+        
+        // результат операции id: байты или -errno
+        ssize_t wait( uint64_t id )
+        {
+            std::unique_lock< std::mutex > lock( mutex );
+            for( ;; )
+            {
+                auto it = completed.find( id );
+                if( it != completed.end() )
+                {
+                    ssize_t result = it->second;
+                    completed.erase( it );
+                    return result;
+                }
+                
+                int error = poll( lock );
+                if( error < 0 )
+                    return error;
+            }
+        }
+    
+    private:
+        /**
+         * Забирает завершения из кольца, при необходимости дождавшись хотя бы одного; 0 или -errno.
+         * Если забирает другой поток, только ждёт его: иначе завершение, взятое между проверкой
+         * и ожиданием в ядре, оставило бы забирающий поток ждать следующего, которого может и не быть.
+         */
+        int poll( std::unique_lock< std::mutex >& lock )
+        {
+            if( polling )
+            {
+                reaped.wait( lock );
+                return 0;
+            }
+            
+            polling = true;
+            int error = 0;
+            if( !reap() )
+            {
+                lock.unlock();
+                int entered = static_cast< int >( ::syscall( __NR_io_uring_enter, ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0 ) );
+                if( entered < 0 && errno != EINTR )
+                    error = -errno;
+                lock.lock();
+                reap();
+            }
+            
+            polling = false;
+            reaped.notify_all();
+            return error;
+        }
+        
+        // под mutex; false - завершений нет
+        bool reap()
+        {
+            unsigned head = *cq_head;
+            unsigned tail = __atomic_load_n( cq_tail, __ATOMIC_ACQUIRE );
+            if( head == tail )
+                return false;
+            
+            for( ; head != tail; ++head )
+            {
+                const io_uring_cqe& cqe = cqes[ head & cq_mask ];
+                completed[ cqe.user_data ] = cqe.res;
+                --in_kernel;
+            }
+            __atomic_store_n( cq_head, head, __ATOMIC_RELEASE );
+            return true;
+        }
+        
+        void close_ring()
+        {
+            if( sqes )
+                ::munmap( sqes, sqes_size );
+            if( cq_ptr && cq_ptr != MAP_FAILED && cq_ptr != sq_ptr )
+                ::munmap( cq_ptr, cq_size );
+            if( sq_ptr && sq_ptr != MAP_FAILED )
+                ::munmap( sq_ptr, sq_size );
+            if( ring_fd >= 0 )
+                ::close( ring_fd );
+            
+            sqes = nullptr;
+            sq_ptr = cq_ptr = nullptr;
+            ring_fd = -1;
+        }
+        
+        pid_t owner;
+        int ring_fd = -1;
+        void* sq_ptr = nullptr;
+        void* cq_ptr = nullptr;
+        size_t sq_size = 0;
+        size_t cq_size = 0;
+        size_t sqes_size = 0;
+        
+        io_uring_sqe* sqes = nullptr;
+        unsigned* sq_tail = nullptr;
+        unsigned* sq_array = nullptr;
+        unsigned sq_mask = 0;
+        
+        io_uring_cqe* cqes = nullptr;
+        unsigned* cq_head = nullptr;
+        unsigned* cq_tail = nullptr;
+        unsigned cq_mask = 0;
+        
+        std::mutex mutex;
+        std::condition_variable reaped;
+        bool polling = false;
+        unsigned capacity = 0;  // размер очереди завершений
+        unsigned in_kernel = 0; // отправлено и ещё не забрано из кольца
+        uint64_t next_id = 1;
+        std::unordered_map< uint64_t, ssize_t > completed;
+    };
+    
+    // кольцо текущего потока; создаётся при первом обращении и заново в процессе, порождённом fork()
+    inline std::shared_ptr< Ring > thread_ring()
+    {
+        thread_local std::shared_ptr< Ring > ring;
+        if( !ring || ring->owner_pid() != ::getpid() )
+            ring = std::make_shared< Ring >();
+        return ring;
+    }
+#endif
+
+    // в процессе, порождённом fork(), потоков io_threads() нет: там Threads работает как Sync
+    inline bool& forked()
+    {
+        static bool forked = false;
+        return forked;
+    }
+    
+    inline void after_fork()
+    {
+        forked() = true;
+    }
+    
+    inline bool io_uring_works()
+    {
+#ifdef MAPREDUCE_HAS_IO_URING
+        static const bool works = Ring().valid(); // в контейнерах io_uring бывает запрещён
+        return works;
+#else
+        return false;
+#endif
+    }
+    
+    inline Backend default_backend()
+    {
+        static const Backend backend = []
+        {
+            const char* choice = std::getenv( "MAPREDUCE_IO" );
+            std::string name = choice ? choice : "";
+            
+            if( name == "sync" )
+                return Backend::Sync;
+            if( name == "threads" || !io_uring_works() )
+                return Backend::Threads;
+            return Backend::IoUring;
+        }();
+        return backend;
+    }
+    
+    inline ssize_t sync_io( bool write, int fd, void* buffer, size_t size, uint64_t offset )
+    {
+        for( ;; )
+        {
+            ssize_t result = write ? ::pwrite( fd, buffer, size, static_cast< off_t >( offset ) )
+                                   : ::pread( fd, buffer, size, static_cast< off_t >( offset ) );
+            if( result >= 0 || errno != EINTR )
+                return result < 0 ? -errno : result;
+        }
+    }
+}
+
+/**
+ * Одна асинхронная операция над открытым дескриптором в каждый момент.
+ * Буфер операции должен жить до wait().
+ */
+class AsyncFile
+{
+public:
+    
+    explicit AsyncFile( int fd, async_io::Backend backend = async_io::default_backend() )
+    : fd( fd )
+    , backend( backend )
+    {}
+    
+    ~AsyncFile()
+    {
+        if( in_flight )
+            wait();
+    }
+    
+    AsyncFile( const AsyncFile& ) = delete;
+    AsyncFile& operator=( const AsyncFile& ) = delete;
+    
+    void start_read( char* buffer, size_t size, uint64_t offset )
+    {
+        start( false, buffer, size, offset );
+    }
+    
+    void start_write( const char* buffer, size_t size, uint64_t offset )
+    {
+        start( true, const_cast< char* >( buffer ), size, offset );
+    }
+    
+    bool pending() const
+    {
+        return in_flight;
+    }
+    
+    // результат последней операции: байты или -errno; запись всегда дописывается до конца
+    ssize_t wait()
+    {
+        if( !in_flight )
+            return 0;
+        in_flight = false;
+        
+        ssize_t result = sync_result;
+        switch( backend )
+        {
+            case async_io::Backend::Sync:
+                break;
+            case async_io::Backend::Threads:
+                result = future.get();
+                break;
+            case async_io::Backend::IoUring:
+#ifdef MAPREDUCE_HAS_IO_URING
+                result = ring->wait( ring_op );
+#endif
+                break;
+        }
+        
+        // короткая запись: остаток дописываем синхронно
+        if( op.write && result >= 0 && static_cast< size_t >( result ) < op.size )
+        {
+            size_t done = static_cast< size_t >( result );
+            while( done < op.size )
+            {
+                ssize_t n = async_io::sync_io( true, fd, op.buffer + done, op.size - done, op.offset + done );
+                if( n <= 0 )
+                    return n < 0 ? n : -EIO;
+                done += static_cast< size_t >( n );
+            }
+            result = static_cast< ssize_t >( done );
+        }
+        
+        return result;
+    }
+    
+private:
+    struct Operation
+    {
+        bool write = false;
+        char* buffer = nullptr;
+        size_t size = 0;
+        uint64_t offset = 0;
+    };
+    
+    void start( bool write, char* buffer, size_t size, uint64_t offset )
+    {
+        if( in_flight )
+            throw std::logic_error( "another I/O operation is in flight" );
+        
+        op = Operation{ write, buffer, size, offset };
+        in_flight = true;
+
+#ifdef MAPREDUCE_HAS_IO_URING
+        if( backend == async_io::Backend::IoUring )
+        {
+            // файл остаётся с кольцом потока, начавшего первую операцию, даже если потом его передадут другому
+            if( !ring )
+                ring = async_io::thread_ring();
+            
+            if( ring->valid() )
+            {
+                ring_op = ring->submit( write ? IORING_OP_WRITE : IORING_OP_READ, fd, buffer, size, offset );
+                if( ring_op )
+                    return;
+            }
+            
+            // кольцо не создалось (исчерпан RLIMIT_MEMLOCK) или ядро не умеет такие операции - дальше через потоки
+            backend = async_io::Backend::Threads;
+        }
+#endif
+
+        if( backend == async_io::Backend::Threads && !async_io::forked() )
+        {
+            auto promise = std::make_shared< std::promise< ssize_t > >();
+            future = promise->get_future();
+            async_io::io_threads().submit( [ promise, write, fd = fd, buffer, size, offset ]
+            {
+                promise->set_value( async_io::sync_io( write, fd, buffer, size, offset ) );
+            } );
+            return;
+        }
+        
+        backend = async_io::Backend::Sync;
+        sync_result = async_io::sync_io( write, fd, buffer, size, offset );
+    }
+    
+    int fd;
+    async_io::Backend backend;
+    bool in_flight = false;
+    Operation op;
+    
+    ssize_t sync_result = 0;
+    std::future< ssize_t > future;
+#ifdef MAPREDUCE_HAS_IO_URING
+    std::shared_ptr< async_io::Ring > ring;
+    uint64_t ring_op = 0;
+#endif
+};
+
+/**
+ * Последовательное чтение файла с упреждением: пока вызывающий разбирает текущий кусок,
+ * следующий уже читается во второй буфер.
+ */
+class ReadAhead
+{
+public:
+    
+    // файла нет или его нельзя прочитать - исключение, а не пустой вход: иначе данные пропали бы молча
+    explicit ReadAhead( const std::filesystem::path& path, size_t chunk_size )
+    : fd( open_file( path ) )
+    , io( fd )
+    , current( std::max< size_t >( chunk_size, 1 ) )
+    , ahead( std::max< size_t >( chunk_size, 1 ) )
+    {
+        io.start_read( ahead.data(), ahead.size(), 0 );
+    }
+    
+    ~ReadAhead()
+    {
+        if( io.pending() )
+            io.wait();
+        ::close( fd );
+    }
+    
+    ReadAhead( const ReadAhead& ) = delete;
+    ReadAhead& operator=( const ReadAhead& ) = delete;
+    
+    // непрочитанный остаток текущего куска (или следующий кусок); данные живут до следующего вызова
+    bool next_chunk( const char*& data, size_t& size )
+    {
+        if( pos == end && !advance() )
+            return false;
+        
+        data = current.data() + pos;
+        size = end - pos;
+        pos = end;
+        return true;
+    }
+    
+    // копирует до size байт, возвращает сколько скопировано (меньше - файл кончился)
+    size_t read( char* out, size_t size )
+    {
+        size_t copied = 0;
+        while( copied < size )
+        {
+            if( pos == end && !advance() )
+                break;
+            
+            size_t chunk = std::min( size - copied, end - pos );
+            std::memcpy( out + copied, current.data() + pos, chunk );
+            pos += chunk;
+            copied += chunk;
+        }
+        return copied;
+    }
+    
+private:
+    static int open_file( const std::filesystem::path& path )
+    {
+        int fd = ::open( path.c_str(), O_RDONLY | O_CLOEXEC );
+        if( fd < 0 )
+            throw std::runtime_error( "can't open " + path.string() + ": " + std::strerror( errno ) );
+        return fd;
+    }
+    
+    bool advance()
+    {
+        if( finished )
+            return false;
+        
+        ssize_t result = io.wait();
+        if( result < 0 )
+            throw std::runtime_error( std::string( "read failed: " ) + std::strerror( static_cast< int >( -result ) ) );
+        
+        if( result == 0 )
+        {
+            finished = true;
+            return false;
+        }
+        
+        std::swap( current, ahead );
+        pos = 0;
+        end = static_cast< size_t >( result );
+        offset += end;
+        
+        io.start_read( ahead.data(), ahead.size(), offset );
+        return true;
+    }
+    
+    int fd;
+    AsyncFile io;
+    std::vector< char > current;
+    std::vector< char > ahead;
+    size_t pos = 0;
+    size_t end = 0;
+    uint64_t offset = 0;
+    bool finished = false;
+};
@@ -0,0 +1,612 @@
+#include "mapreduce.h"
+#include "memory_shuffle.h"
+#include "output_sink.h"
+#include "sort_combiner.h"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#ifndef MAPREDUCE_BUILD_TYPE
+#define MAPREDUCE_BUILD_TYPE ""
+#endif
+
+/**
+ * Бенчмарки фреймворка на синтетических данных.
+ *
+ * Генератор детерминирован: одинаковые параметры и зерно дают байт в байт одинаковый файл,
+ * поэтому результаты разных сборок можно сравнивать. Параметры данных:
+ *     --size MB          размер файла;
+ *     --lines MIN:MAX    длины строк;
+ *     --shape K          распределение длин: 1 - равномерное, больше 1 - больше коротких строк и длинный хвост;
+ *     --collisions P     доля строк с длинным общим префиксом с одной из недавних строк;
+ *     --skew P           доля строк из небольшого набора горячих (повторяющихся) строк;
+ *     --seed N
+ *
+ * Микробенчмарки: split_file, цикл чтения строк маппера, комбайнер (сортировка с бюджетом и со сбросами),
+ * перемешивание (в памяти и со сбросами), фаза reduce. Сквозные запуски перебирают
+ * количества мапперов и редьюсеров (--mappers 1,2,4 --reducers 1,4).
+ *
+ * --scratch DIR - каталог для промежуточных файлов заданий (например, tmpfs), по умолчанию TMPDIR.
+ *
+ * Каждый бенчмарк выполняется в отдельном процессе, поэтому peak_rss_kb - пик именно этого бенчмарка.
+ * Результаты - JSON в --out FILE или в stdout. --filter TEXT оставляет бенчмарки, в имени которых есть TEXT.
+ *
+ *     mapreduce_bench --size 64 --skew 0.2 --out results.json
+ *     mapreduce_bench --generate input.txt --size 16 --collisions 0.5
+ */
+
+struct DataSpec
+{
+    uint64_t bytes = 32 << 20;
+    size_t min_length = 8;
+    size_t max_length = 64;
+    double shape = 1.0;
+    double collisions = 0.1;
+    double skew = 0.0;
+    uint64_t seed = 1;
+};
+
+struct BenchConfig
+{
+    DataSpec data;
+    int repeat = 3;
+    std::vector< int > mappers{ 1, 2, 4 };
+    std::vector< int > reducers{ 1, 4 };
+    size_t shuffle_memory = 256 << 20;
+    std::string filter;
+    std::filesystem::path dir = "mapreduce_bench_data";
+    std::filesystem::path scratch; // промежуточные файлы заданий; пусто - TMPDIR
+    std::filesystem::path out;
+};
+
+// одно выполнение бенчмарка: сколько обработано
+struct Measurement
+{
+    double seconds = 0;
+    uint64_t bytes = 0;
+    uint64_t records = 0;
+    uint64_t operations = 1;
+};
+
+/**
+ * Бенчмарк: prepare готовит вход и не замеряется (вызывается перед каждым повтором),
+ * measure замеряется и сообщает объём обработанного.
+ */
+struct Benchmark
+{
+    std::string name;
+    std::function< void () > prepare;
+    std::function< void ( Measurement& ) > measure;
+};
+
+// равномерное [0, 1) из генератора; std::uniform_real_distribution зависит от реализации библиотеки
+static double uniform( std::mt19937_64& random )
+{
+    return static_cast< double >( random() >> 11 ) * 0x1.0p-53;
+}
+
+static void random_letters( std::mt19937_64& random, size_t count, std::string& out )
+{
+    for( size_t i = 0; i < count; ++i )
+        out.push_back( static_cast< char >( 'a' + random() % 26 ) );
+}
+
+static void generate( const DataSpec& spec, const std::filesystem::path& path )
+{
+    static constexpr size_t HOT_LINES = 16;
+    static constexpr size_t RECENT_LINES = 256;
+    
+    std::mt19937_64 random( spec.seed );
+    
+    auto random_length = [ &spec, &random ]
+    {
+        double u = std::pow( uniform( random ), spec.shape );
+        return spec.min_length + static_cast< size_t >( u * static_cast< double >( spec.max_length - spec.min_length + 1 ) );
+    };
+    
+    std::vector< std::string > hot( HOT_LINES );
+    for( auto& line : hot )
+        random_letters( random, random_length(), line );
+    
+    std::vector< std::string > recent( RECENT_LINES );
+    size_t recent_count = 0;
+    
+    std::FILE* file = std::fopen( path.string().c_str(), "wb" );
+    if( !file )
+        throw std::runtime_error( "can't open " + path.string() );
+    
+    OutputSink out( file );
+    std::string line;
+    
+    while( out.bytes_written() < spec.bytes )
+    {
+        double kind = uniform( random );
+        line.clear();
+        
+        if( kind < spec.skew )
+        {
+            // горячие строки тоже неравны: первые встречаются чаще
+            double u = uniform( random );
+            line = hot[ static_cast< size_t >( u * u * HOT_LINES ) ];
+        }
+        else if( kind < spec.skew + spec.collisions && recent_count )
+        {
+            const std::string& base = recent[ random() % std::min( recent_count, RECENT_LINES ) ];
+            size_t shared = base.size() / 2 + random() % ( base.size() / 2 + 1 );
+            line.assign( base, 0, shared );
+            random_letters( random, 1 + random() % 8, line );
+        }
+        else
+        {
+            random_letters( random, random_length(), line );
+        }
+        
+        recent[ recent_count++ % RECENT_LINES ] = line;
+        
+        out.separate();
+        out.write( line );
+    }
+    
+    out.close();
+    std::fclose( file );
+}
+
+struct CountReducer
+{
+    bool operator()( std::pair< std::string, int64_t >& data )
+    {
+        keys += data.second > 0;
+        return true;
+    }
+    
+    uint64_t keys = 0;
+};
+
+struct LineMapper
+{
+    template< typename Emit >
+    void operator()( std::string_view line, Emit& emit ) const
+    {
+        emit( line, 1 );
+    }
+};
+
+using BenchMapReduce = BasicMapReduce< std::string, int64_t, LineMapper, CountReducer >;
+using BenchCombiner = BasicSortCombiner< std::string, int64_t >;
+using BenchWriter = BasicRecordWriter< std::string, int64_t >;
+
+static uint64_t size_of( const std::filesystem::path& path )
+{
+    return static_cast< uint64_t >( std::filesystem::file_size( path ) );
+}
+
+// все строки входа ключами с единицей - то, что пишет в свой файл маппер
+static void write_records( const std::filesystem::path& input, const std::string& output )
+{
+    MappedFile mapped( input );
+    BenchWriter writer( output );
+    for_each_line( mapped.view( 0, mapped.size() ), [ &writer ]( std::string_view line )
+    {
+        writer.write( line, 1 );
+        return true;
+    } );
+}
+
+static std::vector< Benchmark > make_benchmarks( const BenchConfig& config, const std::filesystem::path& input )
+{
+    std::vector< Benchmark > benchmarks;
+    
+    for( int blocks : { 8, 64 } )
+    {
+        benchmarks.push_back( { "split_file/blocks" + std::to_string( blocks ), nullptr, [ input, blocks ]( Measurement& m )
+        {
+            static constexpr int CALLS = 200;
+            for( int i = 0; i < CALLS; ++i )
+                BenchMapReduce::split_file( input, blocks );
+            m.operations = CALLS;
+        } } );
+    }
+    
+    benchmarks.push_back( { "read_loop/mapped", nullptr, [ input ]( Measurement& m )
+    {
+        MappedFile mapped( input );
+        for_each_line( mapped.view( 0, mapped.size() ), [ &m ]( std::string_view line )
+        {
+            m.bytes += line.size() + 1;
+            ++m.records;
+            return true;
+        } );
+    } } );
+    
+    benchmarks.push_back( { "read_loop/stream", nullptr, [ input ]( Measurement& m )
+    {
+        std::ifstream is( input.string(), std::ios::binary );
+        for_each_line( is, size_of( input ), [ &m ]( std::string_view line )
+        {
+            m.bytes += line.size() + 1;
+            ++m.records;
+            return true;
+        } );
+    } } );
+    
+    // с бюджетом 4 МБ комбайнер сбрасывает серии на диск и сливает их
+    for( size_t budget : { BenchCombiner::DEFAULT_MEMORY_BUDGET, size_t( 4 ) << 20 } )
+    {
+        std::string name = "combine/budget" + std::to_string( budget >> 20 ) + "mb";
+        benchmarks.push_back( { name, [ input ] { write_records( input, "combine.bin" ); }, [ budget ]( Measurement& m )
+        {
+            m.bytes = size_of( "combine.bin" );
+            BenchCombiner combiner( budget );
+            combiner( "combine.bin", 0 );
+        } } );
+    }
+    
+    // таблицы партиций и слияние их серий - то, что происходит между map и reduce
+    for( size_t budget : { size_t( 1 ) << 30, size_t( 4 ) << 20 } )
+    {
+        std::string name = "shuffle/budget" + std::to_string( budget >> 20 ) + "mb";
+        benchmarks.push_back( { name, nullptr, [ input, budget ]( Measurement& m )
+        {
+            static constexpr int PARTITIONS = 8;
+            
+            MappedFile mapped( input );
+            MemoryBudget memory( budget );
+            PartitionTables< std::string, int64_t > tables( PARTITIONS, memory, []( int r, int spill )
+            {
+                return "shuffle" + std::to_string( r ) + "_" + std::to_string( spill ) + ".bin";
+            } );
+            
+            HashPartitioner partitioner;
+            for_each_line( mapped.view( 0, mapped.size() ), [ & ]( std::string_view line )
+            {
+                tables.add( partitioner( line, PARTITIONS ), line, 1 );
+                m.bytes += line.size() + 1;
+                return true;
+            } );
+            
+            auto runs = tables.seal();
+            for( int r = 0; r < PARTITIONS; ++r )
+            {
+                BasicKWayMerge< std::string, int64_t > merge( tables.spilled_files()[ r ], { &runs[ r ] } );
+                for( std::pair< std::string, int64_t > record; merge.next( record ); )
+                    ++m.records;
+            }
+            
+            memory.release( tables.take_reserved() );
+        } } );
+    }
+    
+    // вход редьюсеров готовится один раз: отсортированные партиции
+    for( int reducers : config.reducers )
+    {
+        std::string name = "reduce/r" + std::to_string( reducers );
+        auto prepared = std::make_shared< bool >( false );
+        
+        auto partition = []( int r ) { return "reduce" + std::to_string( r ) + ".bin"; };
+        
+        auto prepare = [ input, reducers, prepared, partition ]
+        {
+            if( std::exchange( *prepared, true ) )
+                return;
+            
+            std::vector< BenchWriter > writers;
+            for( int r = 0; r < reducers; ++r )
+                writers.emplace_back( partition( r ) );
+            
+            MappedFile mapped( input );
+            HashPartitioner partitioner;
+            for_each_line( mapped.view( 0, mapped.size() ), [ & ]( std::string_view line )
+            {
+                writers[ partitioner( line, reducers ) ].write( line, 1 );
+                return true;
+            } );
+            writers.clear();
+            
+            BenchCombiner combiner;
+            for( int r = 0; r < reducers; ++r )
+                combiner( partition( r ), r );
+        };
+        
+        benchmarks.push_back( { name, prepare, [ reducers, partition, scratch = config.scratch ]( Measurement& m )
+        {
+            std::vector< std::string > partitions;
+            for( int r = 0; r < reducers; ++r )
+            {
+                partitions.push_back( partition( r ) );
+                m.bytes += size_of( partitions.back() );
+            }
+            
+            BenchMapReduce mr( 1, reducers );
+            mr.set_scratch_directory( scratch );
+            mr.set_reducer( CountReducer() );
+            RunResult result = mr.run_reduce( partitions );
+            m.records = result.metrics.phase( job_metrics::Phase::Reduce ).records_in;
+        } } );
+    }
+    
+    for( size_t shuffle_memory : { size_t( 0 ), config.shuffle_memory } )
+    {
+        if( shuffle_memory == 0 && config.shuffle_memory == 0 )
+            continue;
+        
+        for( int mappers : config.mappers )
+        {
+            for( int reducers : config.reducers )
+            {
+                std::string name = std::string( "end_to_end/" ) + ( shuffle_memory ? "memory" : "files" )
+                                 + "/m" + std::to_string( mappers ) + "_r" + std::to_string( reducers );
+                
+                benchmarks.push_back( { name, nullptr, [ input, mappers, reducers, shuffle_memory, scratch = config.scratch ]( Measurement& m )
+                {
+                    BenchMapReduce mr( mappers, reducers );
+                    mr.set_scratch_directory( scratch );
+                    mr.set_mapper( LineMapper() );
+                    mr.set_reducer( CountReducer() );
+                    mr.set_shuffle_memory( shuffle_memory );
+                    
+                    RunResult result = mr.run( input );
+                    m.bytes = size_of( input );
+                    m.records = result.metrics.phase( job_metrics::Phase::Map ).records_in;
+                } } );
+            }
+        }
+    }
+    
+    return benchmarks;
+}
+
+// повторы бенчмарка; результат - JSON-объект без peak_rss_kb (его добавляет родитель)
+static std::string run_benchmark( const Benchmark& benchmark, int repeat )
+{
+    using Clock = std::chrono::steady_clock;
+    
+    Measurement best;
+    double total = 0;
+    
+    for( int i = 0; i < repeat; ++i )
+    {
+        if( benchmark.prepare )
+            benchmark.prepare();
+        
+        Measurement m;
+        auto start = Clock::now();
+        benchmark.measure( m );
+        m.seconds = std::chrono::duration< double >( Clock::now() - start ).count();
+        
+        total += m.seconds;
+        if( i == 0 || m.seconds < best.seconds )
+            best = m;
+    }
+    
+    std::ostringstream json;
+    json << "{\"name\":\"" << benchmark.name << "\""
+         << ",\"repeat\":" << repeat
+         << ",\"best_seconds\":" << best.seconds
+         << ",\"mean_seconds\":" << total / repeat
+         << ",\"bytes\":" << best.bytes
+         << ",\"records\":" << best.records
+         << ",\"operations\":" << best.operations;
+    
+    if( best.seconds > 0 )
+    {
+        if( best.bytes )
+            json << ",\"mb_per_s\":" << static_cast< double >( best.bytes ) / ( 1 << 20 ) / best.seconds;
+        if( best.records )
+            json << ",\"records_per_s\":" << static_cast< double >( best.records ) / best.seconds;
+        json << ",\"ns_per_operation\":" << best.seconds * 1e9 / static_cast< double >( best.operations );
+    }
+    
+    return json.str();
+}
+
+/**
+ * Запускает бенчмарк в дочернем процессе и возвращает его JSON с пиком памяти процесса.
+ * Родитель сам не создаёт потоков и не трогает фреймворк, поэтому fork безопасен.
+ */
+static std::string run_isolated( const Benchmark& benchmark, const BenchConfig& config )
+{
+    int fds[ 2 ];
+    if( ::pipe( fds ) != 0 )
+        throw std::runtime_error( "pipe failed" );
+    
+    pid_t pid = ::fork();
+    if( pid < 0 )
+        throw std::runtime_error( "fork failed" );
+    
+    if( pid == 0 )
+    {
+        ::close( fds[ 0 ] );
+        int code = 0;
+        std::string json;
+        try
+        {
+            std::filesystem::current_path( config.dir );
+            json = run_benchmark( benchmark, config.repeat );
+        }
+        catch( const std::exception& e )
+        {
+            json = "{\"name\":\"" + benchmark.name + "\",\"error\":\"" + e.what() + "\"";
+            code = 1;
+        }
+        
+        for( size_t done = 0; done < json.size(); )
+        {
+            ssize_t written = ::write( fds[ 1 ], json.data() + done, json.size() - done );
+            if( written <= 0 )
+                break;
+            done += static_cast< size_t >( written );
+        }
+        ::_exit( code );
+    }
+    
+    ::close( fds[ 1 ] );
+    std::string json;
+    char buff[ 4096 ];
+    for( ssize_t got; ( got = ::read( fds[ 0 ], buff, sizeof( buff ) ) ) != 0; )
+    {
+        if( got > 0 )
+            json.append( buff, static_cast< size_t >( got ) );
+        else if( errno != EINTR )
+            break;
+    }
+    ::close( fds[ 0 ] );
+    
+    int status = 0;
+    rusage usage{};
+    while( ::wait4( pid, &status, 0, &usage ) < 0 && errno == EINTR )
+    {
+    }
+    
+    if( json.empty() )
+        json = "{\"name\":\"" + benchmark.name + "\",\"error\":\"crashed\"";
+    
+    return json + ",\"peak_rss_kb\":" + std::to_string( usage.ru_maxrss ) + "}";
+}
+
+static std::vector< int > parse_list( const std::string& text )
+{
+    std::vector< int > values;
+    std::istringstream is( text );
+    for( std::string item; std::getline( is, item, ',' ); )
+        values.push_back( std::max( std::stoi( item ), 1 ) );
+    return values;
+}
+
+static std::string spec_json( const DataSpec& spec )
+{
+    std::ostringstream json;
+    json << "{\"bytes\":" << spec.bytes
+         << ",\"min_length\":" << spec.min_length
+         << ",\"max_length\":" << spec.max_length
+         << ",\"shape\":" << spec.shape
+         << ",\"collisions\":" << spec.collisions
+         << ",\"skew\":" << spec.skew
+         << ",\"seed\":" << spec.seed << "}";
+    return json.str();
+}
+
+static void usage( const char* name )
+{
+    std::cerr << "usage: " << name << " [--size MB] [--lines MIN:MAX] [--shape K] [--collisions P] [--skew P] [--seed N]\n"
+              << "       [--repeat N] [--mappers LIST] [--reducers LIST] [--shuffle-memory MB]\n"
+              << "       [--filter TEXT] [--dir DIR] [--scratch DIR] [--out FILE]\n"
+              << "       " << name << " --generate FILE [data options]" << std::endl;
+}
+
+int main( int argc, char* argv[] )
+{
+    BenchConfig config;
+    std::filesystem::path generate_only;
+    
+    try
+    {
+        for( int i = 1; i < argc; ++i )
+        {
+            std::string option = argv[ i ];
+            if( i + 1 == argc )
+                throw std::invalid_argument( option );
+            std::string value = argv[ ++i ];
+            
+            if( option == "--size" )
+                config.data.bytes = std::stoull( value ) << 20;
+            else if( option == "--lines" )
+            {
+                size_t colon = value.find( ':' );
+                config.data.min_length = std::stoul( value.substr( 0, colon ) );
+                config.data.max_length = colon == std::string::npos ? config.data.min_length : std::stoul( value.substr( colon + 1 ) );
+                if( config.data.max_length < config.data.min_length )
+                    throw std::invalid_argument( value );
+            }
+            else if( option == "--shape" )
+                config.data.shape = std::stod( value );
+            else if( option == "--collisions" )
+                config.data.collisions = std::stod( value );
+            else if( option == "--skew" )
+                config.data.skew = std::stod( value );
+            else if( option == "--seed" )
+                config.data.seed = std::stoull( value );
+            else if( option == "--repeat" )
+                config.repeat = std::max( std::stoi( value ), 1 );
+            else if( option == "--mappers" )
+                config.mappers = parse_list( value );
+            else if( option == "--reducers" )
+                config.reducers = parse_list( value );
+            else if( option == "--shuffle-memory" )
+                config.shuffle_memory = std::stoull( value ) << 20;
+            else if( option == "--filter" )
+                config.filter = value;
+            else if( option == "--dir" )
+                config.dir = value;
+            else if( option == "--scratch" )
+                config.scratch = std::filesystem::absolute( value );
+            else if( option == "--out" )
+                config.out = value;
+            else if( option == "--generate" )
+                generate_only = value;
+            else
+                throw std::invalid_argument( option );
+        }
+    }
+    catch( const std::exception& )
+    {
+        usage( argv[ 0 ] );
+        return 1;
+    }
+    
+    if( !generate_only.empty() )
+    {
+        generate( config.data, generate_only );
+        return 0;
+    }
+    
+    std::filesystem::create_directories( config.dir );
+    config.dir = std::filesystem::absolute( config.dir );
+    
+    std::filesystem::path input = config.dir / "input.txt";
+    generate( config.data, input );
+    
+    std::string json = "{\"build_type\":\"" MAPREDUCE_BUILD_TYPE "\",\"metrics\":" + std::string( job_metrics::ENABLED ? "true" : "false" )
+                     + ",\"data\":" + spec_json( config.data ) + ",\"results\":[";
+    bool first = true;
+    
+    for( const Benchmark& benchmark : make_benchmarks( config, input ) )
+    {
+        if( benchmark.name.find( config.filter ) == std::string::npos )
+            continue;
+        
+        std::cerr << benchmark.name << std::endl;
+        
+        json += first ? "\n" : ",\n";
+        json += run_isolated( benchmark, config );
+        first = false;
+    }
+    
+    json += "\n]}\n";
+    
+    if( config.out.empty() )
+    {
+        OutputSink out( stdout );
+        out.write( json );
+    }
+    else
+    {
+        OutputSink out( config.out );
+        out.write( json );
+    }
+    
+    return 0;
+}
@@ -0,0 +1,190 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+/**
+ * Быстрый блочный кодек в духе LZ4: только повторы на расстоянии до 64 КБ и литералы, без энтропийного кодирования.
+ * Сжимает и распаковывает сотни мегабайт в секунду - для промежуточных файлов важнее скорость, чем степень сжатия.
+ *
+ * Блок - последовательность команд:
+ *     токен         старшие 4 бита - длина литералов, младшие - длина повтора минус MIN_MATCH
+ *                   (15 - длина продолжается байтами: 255, 255, ..., остаток)
+ *     литералы
+ *     смещение      2 байта, little-endian; нет у последней команды блока
+ *     хвост длины повтора
+ */
+namespace block_codec
+{
+    static constexpr size_t MIN_MATCH = 4;
+    static constexpr size_t MAX_OFFSET = 65535;
+    static constexpr int HASH_BITS = 13;
+    
+    // сколько байт может занять сжатый блок в худшем случае
+    inline size_t compress_bound( size_t size )
+    {
+        return size + size / 255 + 16;
+    }
+    
+    namespace detail
+    {
+        inline uint32_t read32( const char* p )
+        {
+            uint32_t value;
+            std::memcpy( &value, p, sizeof( value ) );
+            return value;
+        }
+        
+        inline uint32_t hash( uint32_t sequence )
+        {
+            return ( sequence * 2654435761u ) >> ( 32 - HASH_BITS );
+        }
+        
+        inline char* put_length( char* out, size_t length )
+        {
+            for( ; length >= 255; length -= 255 )
+                *out++ = static_cast< char >( 255 );
+            *out++ = static_cast< char >( length );
+            return out;
+        }
+        
+        inline char* put_sequence( char* out, const char* literals, size_t literals_size, size_t offset, size_t match_size )
+        {
+            char* token = out++;
+            size_t literal_code = literals_size < 15 ? literals_size : 15;
+            size_t match_code = 0;
+            
+            if( literal_code == 15 )
+                out = put_length( out, literals_size - 15 );
+            std::memcpy( out, literals, literals_size );
+            out += literals_size;
+            
+            if( match_size )
+            {
+                *out++ = static_cast< char >( offset & 0xff );
+                *out++ = static_cast< char >( offset >> 8 );
+                
+                size_t extra = match_size - MIN_MATCH;
+                match_code = extra < 15 ? extra : 15;
+                if( match_code == 15 )
+                    out = put_length( out, extra - 15 );
+            }
+            
+            *token = static_cast< char >( ( literal_code << 4 ) | match_code );
+            return out;
+        }
+        
+        // продолжение длины; false - вход кончился
+        inline bool get_length( const unsigned char*& in, const unsigned char* end, size_t& length )
+        {
+            for( ;; )
+            {
+                if( in == end )
+                    return false;
+                
+                unsigned char byte = *in++;
+                length += byte;
+                if( byte != 255 )
+                    return true;
+            }
+        }
+    }
+    
+    // сжимает size байт из src в dst (не меньше compress_bound( size ) байт), возвращает размер результата
+    inline size_t compress( const char* src, size_t size, char* dst )
+    {
+        uint32_t table[ 1 << HASH_BITS ] = {};
+        
+        const char* anchor = src; // начало ещё не записанных литералов
+        const char* in = src;
+        const char* end = src + size;
+        char* out = dst;
+        
+        // последние байты всегда уходят литералами, чтобы поиск повтора не читал за концом блока
+        const char* match_limit = size > MIN_MATCH + 8 ? end - MIN_MATCH - 8 : src;
+        
+        while( in < match_limit )
+        {
+            uint32_t sequence = detail::read32( in );
+            uint32_t& slot = table[ detail::hash( sequence ) ];
+            const char* candidate = src + slot;
+            slot = static_cast< uint32_t >( in - src );
+            
+            if( candidate >= in || static_cast< size_t >( in - candidate ) > MAX_OFFSET || detail::read32( candidate ) != sequence )
+            {
+                ++in;
+                continue;
+            }
+            
+            const char* match_end = in + MIN_MATCH;
+            const char* from = candidate + MIN_MATCH;
+            while( match_end < end - 8 && *match_end == *from )
+            {
+                ++match_end;
+                ++from;
+            }
+            
+            out = detail::put_sequence( out, anchor, static_cast< size_t >( in - anchor ),
+                                        static_cast< size_t >( in - candidate ), static_cast< size_t >( match_end - in ) );
+            in = anchor = match_end;
+        }
+        
+        out = detail::put_sequence( out, anchor, static_cast< size_t >( end - anchor ), 0, 0 );
+        return static_cast< size_t >( out - dst );
+    }
+    
+    // распаковывает блок в dst ровно на size байт; false - блок повреждён
+    inline bool decompress( const char* src, size_t packed_size, char* dst, size_t size )
+    {
+        auto in = reinterpret_cast< const unsigned char* >( src );
+        auto in_end = in + packed_size;
+        char* out = dst;
+        char* out_end = dst + size;
+        
+        while( in != in_end )
+        {
+            unsigned token = *in++;
+            
+            size_t literals = token >> 4;
+            if( literals == 15 && !detail::get_length( in, in_end, literals ) )
+                return false;
+            if( literals > static_cast< size_t >( in_end - in ) || literals > static_cast< size_t >( out_end - out ) )
+                return false;
+            
+            std::memcpy( out, in, literals );
+            in += literals;
+            out += literals;
+            
+            if( in == in_end ) // последняя команда - только литералы
+                break;
+            
+            if( in_end - in < 2 )
+                return false;
+            size_t offset = in[ 0 ] | ( static_cast< size_t >( in[ 1 ] ) << 8 );
+            in += 2;
+            
+            size_t match = token & 15;
+            if( match == 15 && !detail::get_length( in, in_end, match ) )
+                return false;
+            match += MIN_MATCH;
+            
+            if( !offset || offset > static_cast< size_t >( out - dst ) || match > static_cast< size_t >( out_end - out ) )
+                return false;
+            
+            // повтор может перекрываться с собой (offset < match) - копируем побайтно
+            const char* from = out - offset;
+            if( offset >= match )
+            {
+                std::memcpy( out, from, match );
+                out += match;
+            }
+            else
+            {
+                for( size_t i = 0; i < match; ++i )
+                    *out++ = from[ i ];
+            }
+        }
+        
+        return out == out_end;
+    }
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <atomic>
+
+/**
+ * Флаг отмены задачи, общий для всех её фаз.
+ * Мапперы, комбайнеры, слияние и редьюсеры проверяют его и завершаются как можно раньше.
+ * Проверка - одно relaxed-чтение, поэтому её можно делать на каждой записи.
+ */
+class CancellationToken
+{
+public:
+    
+    void cancel()
+    {
+        flag.store( true, std::memory_order_relaxed );
+    }
+    
+    bool cancelled() const
+    {
+        return flag.load( std::memory_order_relaxed );
+    }
+    
+    void reset()
+    {
+        flag.store( false, std::memory_order_relaxed );
+    }
+    
+private:
+    std::atomic< bool > flag{ false };
+};
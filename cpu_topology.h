@@ -0,0 +1,164 @@
+#pragma once
+
+#include <sched.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+/**
+ * Топология процессора: NUMA-узлы и их ядра, прочитанные из sysfs (/sys/devices/system/node и .../cpu).
+ * Берутся только ядра, на которых процессу разрешено работать (sched_getaffinity: taskset, cgroup cpuset).
+ * Если узлов в sysfs нет (ядро без NUMA, контейнер без /sys), вся машина - один узел.
+ *
+ * Ядра узла упорядочены для заполнения: сначала по одному аппаратному потоку (SMT) на каждое физическое ядро,
+ * потом вторые потоки - соседи по ядру делят его кеши и конвейер, поэтому занимаем их в последнюю очередь.
+ */
+struct CpuTopology
+{
+    std::vector< std::vector< int > > nodes;
+    
+    static constexpr const char* SYSFS = "/sys/devices/system";
+    
+    // allowed - ядра, на которых можно работать; по умолчанию - маска процесса
+    static CpuTopology detect( const std::filesystem::path& sysfs = SYSFS, const std::vector< int >& allowed = allowed_cpus() )
+    {
+        CpuTopology topology;
+        
+        std::vector< std::pair< int, std::filesystem::path > > node_dirs;
+        std::error_code error;
+        for( std::filesystem::directory_iterator it( sysfs / "node", error ), end; !error && it != end; it.increment( error ) )
+        {
+            std::string name = it->path().filename().string();
+            if( name.size() > 4 && name.compare( 0, 4, "node" ) == 0
+                && std::all_of( name.begin() + 4, name.end(), []( char c ) { return c >= '0' && c <= '9'; } ) )
+                node_dirs.emplace_back( std::atoi( name.c_str() + 4 ), it->path() );
+        }
+        std::sort( node_dirs.begin(), node_dirs.end() );
+        
+        for( const auto& node : node_dirs )
+        {
+            std::vector< int > cpus;
+            for( int cpu : parse_cpu_list( read_line( node.second / "cpulist" ) ) )
+            {
+                if( std::binary_search( allowed.begin(), allowed.end(), cpu ) )
+                    cpus.push_back( cpu );
+            }
+            
+            // узел без разрешённых ядер (или только с памятью) потокам не достаётся
+            if( !cpus.empty() )
+                topology.nodes.push_back( std::move( cpus ) );
+        }
+        
+        if( topology.nodes.empty() )
+            topology.nodes.push_back( allowed );
+        
+        for( auto& cpus : topology.nodes )
+            order_by_core( sysfs, cpus );
+        
+        return topology;
+    }
+    
+    size_t cpus_count() const
+    {
+        size_t count = 0;
+        for( const auto& cpus : nodes )
+            count += cpus.size();
+        return count;
+    }
+    
+    /**
+     * Место потока worker из threads: потоки делятся между узлами поровну непрерывными группами
+     * (соседние потоки - на одном узле), внутри узла занимают ядра по порядку заполнения.
+     * Возвращает узел и ядро.
+     */
+    std::pair< int, int > place( size_t worker, size_t threads ) const
+    {
+        size_t node = std::min( worker * nodes.size() / std::max< size_t >( threads, 1 ), nodes.size() - 1 );
+        size_t first = ( node * threads + nodes.size() - 1 ) / nodes.size(); // первый поток этого узла
+        
+        const auto& cpus = nodes[ node ];
+        return { static_cast< int >( node ), cpus[ ( worker - first ) % cpus.size() ] };
+    }
+    
+    // "0-3,8,10-11" -> 0 1 2 3 8 10 11
+    static std::vector< int > parse_cpu_list( std::string_view list )
+    {
+        std::vector< int > cpus;
+        
+        while( !list.empty() )
+        {
+            size_t comma = list.find( ',' );
+            std::string range( list.substr( 0, comma ) );
+            list = comma == std::string_view::npos ? std::string_view() : list.substr( comma + 1 );
+            
+            if( range.empty() || !std::isdigit( static_cast< unsigned char >( range[ 0 ] ) ) )
+                continue;
+            
+            char* end = nullptr;
+            long from = std::strtol( range.c_str(), &end, 10 );
+            long to = *end == '-' ? std::strtol( end + 1, nullptr, 10 ) : from;
+            for( long cpu = from; cpu <= to; ++cpu )
+                cpus.push_back( static_cast< int >( cpu ) );
+        }
+        
+        return cpus;
+    }
+    
+    // ядра, на которых разрешено работать процессу, по возрастанию
+    static std::vector< int > allowed_cpus()
+    {
+        std::vector< int > cpus;
+        
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        if( ::sched_getaffinity( 0, sizeof( set ), &set ) == 0 )
+        {
+            for( int cpu = 0; cpu < CPU_SETSIZE; ++cpu )
+            {
+                if( CPU_ISSET( cpu, &set ) )
+                    cpus.push_back( cpu );
+            }
+        }
+        
+        if( cpus.empty() )
+        {
+            for( unsigned cpu = 0; cpu < std::max( std::thread::hardware_concurrency(), 1u ); ++cpu )
+                cpus.push_back( static_cast< int >( cpu ) );
+        }
+        
+        return cpus;
+    }
+    
+private:
+    static std::string read_line( const std::filesystem::path& file )
+    {
+        std::ifstream is( file );
+        std::string line;
+        std::getline( is, line );
+        return line;
+    }
+    
+    // номер аппаратного потока среди соседей по физическому ядру: 0 - первый поток ядра
+    static void order_by_core( const std::filesystem::path& sysfs, std::vector< int >& cpus )
+    {
+        std::vector< std::pair< int, int > > ranked;
+        for( int cpu : cpus )
+        {
+            auto siblings = parse_cpu_list( read_line( sysfs / "cpu" / ( "cpu" + std::to_string( cpu ) ) / "topology" / "thread_siblings_list" ) );
+            int rank = static_cast< int >( std::find( siblings.begin(), siblings.end(), cpu ) - siblings.begin() );
+            ranked.emplace_back( siblings.empty() ? 0 : rank, cpu );
+        }
+        
+        std::sort( ranked.begin(), ranked.end() );
+        for( size_t i = 0; i < cpus.size(); ++i )
+            cpus[ i ] = ranked[ i ].second;
+    }
+};
@@ -0,0 +1,127 @@
+#include "output_sink.h"
+#include "record_io.h"
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+/**
+ * Печатает файлы промежуточных данных (mapperN.bin, reducerN.bin, ленты сортировки)
+ * в текстовом виде: по одной паре "ключ значение" на строку.
+ *
+ * Типы ключа и значения в файле не записаны, поэтому их задают опциями --key и --value.
+ * По умолчанию string и int (как у MapReduce). Знаковые целые любой ширины кодируются одинаково
+ * (zigzag varint) и читаются как int, беззнаковые - как uint.
+ */
+
+namespace
+{
+    enum class Kind { string, signed_int, unsigned_int };
+    
+    bool parse_kind( const char* name, Kind& kind )
+    {
+        if( !std::strcmp( name, "string" ) )
+            kind = Kind::string;
+        else if( !std::strcmp( name, "int" ) )
+            kind = Kind::signed_int;
+        else if( !std::strcmp( name, "uint" ) )
+            kind = Kind::unsigned_int;
+        else
+            return false;
+        return true;
+    }
+    
+    void write_field( OutputSink& out, const std::string& value )
+    {
+        out.write( value );
+    }
+    
+    template< typename T >
+    void write_field( OutputSink& out, T value )
+    {
+        out.write( std::to_string( value ) );
+    }
+    
+    template< typename Key, typename Value >
+    void dump( const char* file, OutputSink& out )
+    {
+        BasicRecordReader< Key, Value > reader( file );
+        
+        std::pair< Key, Value > record;
+        while( reader.read( record ) )
+        {
+            out.separate();
+            write_field( out, record.first );
+            out.write( " " );
+            write_field( out, record.second );
+        }
+    }
+    
+    template< typename Key >
+    void dump( const char* file, Kind value, OutputSink& out )
+    {
+        switch( value )
+        {
+        case Kind::string:       dump< Key, std::string >( file, out ); break;
+        case Kind::signed_int:   dump< Key, int64_t >( file, out ); break;
+        case Kind::unsigned_int: dump< Key, uint64_t >( file, out ); break;
+        }
+    }
+    
+    void dump( const char* file, Kind key, Kind value, OutputSink& out )
+    {
+        switch( key )
+        {
+        case Kind::string:       dump< std::string >( file, value, out ); break;
+        case Kind::signed_int:   dump< int64_t >( file, value, out ); break;
+        case Kind::unsigned_int: dump< uint64_t >( file, value, out ); break;
+        }
+    }
+    
+    int usage( const char* program )
+    {
+        std::cerr << "usage: " << program << " [--key TYPE] [--value TYPE] FILE...\n"
+                  << "TYPE: string, int (any signed integer), uint (any unsigned integer); default --key string --value int.\n"
+                  << "Key/value types are not stored in the file: wrong types print garbage or fail to read." << std::endl;
+        return 1;
+    }
+}
+
+int main( int argc, char* argv[] )
+{
+    Kind key = Kind::string;
+    Kind value = Kind::signed_int;
+    
+    int i = 1;
+    for( ; i < argc; ++i )
+    {
+        bool is_key = !std::strcmp( argv[ i ], "--key" );
+        if( !is_key && std::strcmp( argv[ i ], "--value" ) )
+            break;
+        if( i + 1 == argc || !parse_kind( argv[ i + 1 ], is_key ? key : value ) )
+            return usage( argv[ 0 ] );
+        ++i;
+    }
+    
+    if( i == argc )
+        return usage( argv[ 0 ] );
+    
+    OutputSink out( stdout );
+    
+    try
+    {
+        for( ; i < argc; ++i )
+            dump( argv[ i ], key, value, out );
+    }
+    catch( const std::exception& e )
+    {
+        out.separate();
+        out.flush();
+        std::cerr << argv[ i ] << ": " << e.what() << std::endl;
+        return 1;
+    }
+    
+    out.separate();
+    
+    return 0;
+}
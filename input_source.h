@@ -0,0 +1,271 @@
+#pragma once
+
+#include <glob.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+#include "line_splitter.h"
+#include "mapped_file.h"
+
+/**
+ * Вход одной map-задачи: строки из кусков [from, to) одного или нескольких файлов
+ * либо строки, уже прочитанные из потока (data).
+ */
+struct InputChunk
+{
+    struct Piece
+    {
+        std::string file;
+        uint64_t from;
+        uint64_t to;
+    };
+    
+    std::vector< Piece > pieces;
+    std::string data;
+    
+    uint64_t size() const
+    {
+        uint64_t total = data.size();
+        for( const Piece& piece : pieces )
+            total += piece.to - piece.from;
+        return total;
+    }
+    
+    // вызывает f для каждой строки куска; f может вернуть false, чтобы остановиться (как в for_each_line)
+    template< typename F >
+    void for_each_line( F&& f ) const
+    {
+        bool stopped = false;
+        auto line = [ &f, &stopped ]( std::string_view text )
+        {
+            stopped = !line_splitter_detail::call( f, text );
+            return !stopped;
+        };
+        
+        ::for_each_line( std::string_view( data ), line );
+        
+        for( const Piece& piece : pieces )
+        {
+            if( stopped )
+                return;
+            
+            // каждый кусок отображаем отдельно: куски одного файла читают разные задачи
+            MappedFile mapped( piece.file );
+            if( mapped.valid() )
+            {
+                mapped.will_need( piece.from, piece.to );
+                ::for_each_line( mapped.view( piece.from, piece.to ), line );
+            }
+            else
+            {
+                std::ifstream is( piece.file, std::ios::binary );
+                is.seekg( static_cast< std::streamoff >( piece.from ), is.beg );
+                ::for_each_line( is, piece.to - piece.from, line );
+            }
+        }
+    }
+    
+    // описание кусков файлов строками - для рабочего процесса (WorkerTask::files); data не передаётся
+    std::vector< std::string > encode() const
+    {
+        std::vector< std::string > fields;
+        for( const Piece& piece : pieces )
+        {
+            fields.push_back( piece.file );
+            fields.push_back( std::to_string( piece.from ) );
+            fields.push_back( std::to_string( piece.to ) );
+        }
+        return fields;
+    }
+    
+    static InputChunk decode( const std::vector< std::string >& fields )
+    {
+        if( fields.size() % 3 )
+            throw std::runtime_error( "malformed input chunk" );
+        
+        InputChunk chunk;
+        for( size_t i = 0; i < fields.size(); i += 3 )
+            chunk.pieces.push_back( { fields[ i ], std::stoull( fields[ i + 1 ] ), std::stoull( fields[ i + 2 ] ) } );
+        return chunk;
+    }
+};
+
+/**
+ * Источник входа, который режет данные на куски примерно по chunk_size байт по границам строк:
+ *     файл                 - большой файл режется на несколько кусков;
+ *     каталог              - все обычные файлы в нём и подкаталогах, по порядку имён;
+ *     маска ("*.txt")      - файлы, подходящие под неё (glob);
+ *     поток (stdin, канал) - читается только вперёд, кусок - прочитанные строки в памяти.
+ * Мелкие файлы собираются в один кусок, поэтому задач не больше, чем нужно, и все примерно одного размера.
+ *
+ * Куски выдаются по одному, next() читает поток по мере надобности - весь вход заранее не просматривается.
+ * next() зовётся из одного потока.
+ */
+class InputSource
+{
+public:
+    
+    static constexpr size_t DEFAULT_CHUNK_SIZE = 8 << 20;
+    
+    explicit InputSource( const std::filesystem::path& path, size_t chunk_size = DEFAULT_CHUNK_SIZE )
+    : chunk_size( std::max< size_t >( chunk_size, 1 ) )
+    {
+        if( std::filesystem::is_directory( path ) )
+        {
+            for( const auto& entry : std::filesystem::recursive_directory_iterator( path ) )
+            {
+                if( entry.is_regular_file() )
+                    files.push_back( entry.path() );
+            }
+            std::sort( files.begin(), files.end() );
+        }
+        else if( !std::filesystem::exists( path ) && path.string().find_first_of( "*?[" ) != std::string::npos )
+        {
+            glob_t found{};
+            if( ::glob( path.c_str(), 0, nullptr, &found ) == 0 )
+            {
+                for( size_t i = 0; i < found.gl_pathc; ++i )
+                {
+                    if( std::filesystem::is_regular_file( found.gl_pathv[ i ] ) )
+                        files.emplace_back( found.gl_pathv[ i ] );
+                }
+            }
+            ::globfree( &found );
+        }
+        else if( std::filesystem::exists( path ) )
+        {
+            files.push_back( path );
+        }
+        
+        if( files.empty() )
+            throw std::runtime_error( "no input files in " + path.string() );
+    }
+    
+    // поток не закрывается
+    explicit InputSource( std::FILE* stream, size_t chunk_size = DEFAULT_CHUNK_SIZE )
+    : chunk_size( std::max< size_t >( chunk_size, 1 ) )
+    , stream( stream )
+    {}
+    
+    InputSource( const InputSource& ) = delete;
+    InputSource& operator=( const InputSource& ) = delete;
+    
+    // куски - диапазоны файлов, которые можно перечитать (например, для выборки ключей)
+    bool seekable() const
+    {
+        return !stream;
+    }
+    
+    // следующий кусок; false - вход кончился
+    bool next( InputChunk& chunk )
+    {
+        chunk.pieces.clear();
+        chunk.data.clear();
+        
+        return stream ? next_from_stream( chunk ) : next_from_files( chunk );
+    }
+    
+private:
+    bool next_from_files( InputChunk& chunk )
+    {
+        uint64_t room = chunk_size;
+        
+        while( room && current < files.size() )
+        {
+            if( !is.is_open() )
+            {
+                is.open( files[ current ], std::ios::binary );
+                if( !is )
+                    throw std::runtime_error( "can't open " + files[ current ].string() );
+                size = std::filesystem::file_size( files[ current ] );
+                offset = 0;
+            }
+            
+            if( offset >= size )
+            {
+                is.close();
+                ++current;
+                continue;
+            }
+            
+            // остаток файла не влезает - режем по концу строки, на которой кусок набирает свой размер
+            uint64_t to = size;
+            if( size - offset <= room )
+            {
+                room -= size - offset;
+            }
+            else
+            {
+                to = find_newline( is, offset + room - 1, size );
+                room = 0;
+            }
+            
+            chunk.pieces.push_back( { files[ current ].string(), offset, to } );
+            offset = to == size ? size : to + 1;
+        }
+        
+        return !chunk.pieces.empty();
+    }
+    
+    bool next_from_stream( InputChunk& chunk )
+    {
+        chunk.data.swap( tail );
+        tail.clear();
+        
+        // читаем, пока кусок не наберёт размер и в нём не найдётся конец строки; длинная строка целиком идёт в кусок
+        size_t target = chunk_size;
+        size_t end = std::string::npos;
+        while( !eof )
+        {
+            if( chunk.data.size() < target )
+            {
+                size_t used = chunk.data.size();
+                chunk.data.resize( target );
+                size_t got = std::fread( &chunk.data[ used ], 1, target - used, stream );
+                chunk.data.resize( used + got );
+                
+                if( got < target - used )
+                {
+                    if( std::ferror( stream ) )
+                        throw std::runtime_error( "input stream read error" );
+                    eof = true;
+                }
+                continue;
+            }
+            
+            end = chunk.data.rfind( '\n' );
+            if( end != std::string::npos )
+                break;
+            target += chunk_size;
+        }
+        
+        if( end != std::string::npos )
+        {
+            tail.assign( chunk.data, end + 1, std::string::npos );
+            chunk.data.resize( end + 1 );
+        }
+        
+        return !chunk.data.empty();
+    }
+    
+    size_t chunk_size;
+    
+    std::vector< std::filesystem::path > files;
+    size_t current = 0;
+    std::ifstream is;
+    uint64_t size = 0;
+    uint64_t offset = 0;
+    
+    std::FILE* stream = nullptr;
+    std::string tail; // начало строки, которое не вошло в предыдущий кусок потока
+    bool eof = false;
+};
@@ -0,0 +1,373 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "output_sink.h"
+
+/**
+ * Метрики задания: время фаз и задач, записи и байты на входе и выходе, сбросы на диск,
+ * самая большая партиция и отстающие задачи. BasicMapReduce возвращает их из run() в RunResult,
+ * а set_trace_file() дополнительно пишет их в формате Chrome trace event (chrome://tracing, Perfetto).
+ *
+ * Сбор выключается при компиляции: -DMAPREDUCE_METRICS=0. Тогда часы не читаются, счётчики не ведутся,
+ * а RunResult::metrics остаётся пустым.
+ */
+#ifndef MAPREDUCE_METRICS
+#define MAPREDUCE_METRICS 1
+#endif
+
+namespace job_metrics
+{
+    constexpr bool ENABLED = MAPREDUCE_METRICS != 0;
+    
+    // фазы пересекаются во времени: в конвейере reduce одной партиции идёт вместе с map остальных
+    enum class Phase
+    {
+        Sample,  // выборка ключей для партиционера по диапазонам
+        Map,
+        Combine, // сортировка файла map-задачи комбайнером
+        Merge,   // промежуточное слияние серий партиции
+        Reduce
+    };
+    
+    constexpr size_t PHASES_COUNT = 5;
+    
+    inline const char* phase_name( Phase phase )
+    {
+        static const char* names[ PHASES_COUNT ] = { "sample", "map", "combine", "merge", "reduce" };
+        return names[ static_cast< size_t >( phase ) ];
+    }
+    
+    using Clock = std::chrono::steady_clock;
+    
+    // небольшой номер текущего потока - для дорожек трассировки
+    inline int thread_number()
+    {
+        static std::atomic< int > next{ 0 };
+        thread_local int number = next++;
+        return number;
+    }
+}
+
+// одна задача; время - в микросекундах от начала задания
+struct TaskMetrics
+{
+    job_metrics::Phase phase;
+    int index;  // номер map-задачи или партиции
+    int thread;
+    uint64_t start_us = 0;
+    uint64_t duration_us = 0;
+    
+    uint64_t records_in = 0;
+    uint64_t bytes_in = 0;
+    uint64_t records_out = 0;
+    uint64_t bytes_out = 0;
+};
+
+struct PhaseMetrics
+{
+    size_t tasks = 0;
+    uint64_t start_us = 0; // от начала первой задачи фазы
+    uint64_t end_us = 0;   // до конца последней
+    
+    uint64_t records_in = 0;
+    uint64_t bytes_in = 0;
+    uint64_t records_out = 0;
+    uint64_t bytes_out = 0;
+    
+    // отстающие: самая долгая задача против медианной
+    uint64_t median_task_us = 0;
+    uint64_t max_task_us = 0;
+    int slowest_task = -1;
+    
+    uint64_t wall_us() const
+    {
+        return end_us - start_us;
+    }
+    
+    double straggler_ratio() const
+    {
+        return median_task_us ? static_cast< double >( max_task_us ) / static_cast< double >( median_task_us ) : 0.0;
+    }
+};
+
+struct JobMetrics
+{
+    uint64_t wall_us = 0;
+    std::array< PhaseMetrics, job_metrics::PHASES_COUNT > phases;
+    std::vector< TaskMetrics > tasks;
+    
+    size_t spills = 0; // сколько раз перемешивание в памяти сбрасывало таблицы на диск
+    
+    // копии отстающих задач (set_speculation) и сколько из них закончили раньше исходной попытки;
+    // обе попытки задачи есть в tasks и учтены в фазах
+    size_t speculative_attempts = 0;
+    size_t speculative_wins = 0;
+    
+    // записи, прочитанные редьюсером каждой партиции, - по ним видно перекос
+    std::vector< uint64_t > partition_records;
+    int largest_partition = -1;
+    
+    const PhaseMetrics& phase( job_metrics::Phase phase ) const
+    {
+        return phases[ static_cast< size_t >( phase ) ];
+    }
+    
+    // записей в самой большой партиции относительно средней, 1.0 - партиции равны
+    double partition_skew() const
+    {
+        if( largest_partition < 0 )
+            return 0.0;
+        
+        uint64_t total = 0;
+        for( uint64_t records : partition_records )
+            total += records;
+        if( !total )
+            return 0.0;
+        
+        return static_cast< double >( partition_records[ static_cast< size_t >( largest_partition ) ] ) * static_cast< double >( partition_records.size() )
+             / static_cast< double >( total );
+    }
+    
+    // задачи как события "X" формата Chrome trace event, по дорожке на поток
+    void write_chrome_trace( const std::filesystem::path& path ) const
+    {
+        OutputSink out( path );
+        out.write( "{\"traceEvents\":[" );
+        
+        for( size_t i = 0; i < tasks.size(); ++i )
+        {
+            const TaskMetrics& task = tasks[ i ];
+            const char* name = job_metrics::phase_name( task.phase );
+            
+            if( i )
+                out.write( "," );
+            out.write( "\n{\"name\":\"" + std::string( name ) + " " + std::to_string( task.index )
+                     + "\",\"cat\":\"" + name
+                     + "\",\"ph\":\"X\",\"pid\":1,\"tid\":" + std::to_string( task.thread )
+                     + ",\"ts\":" + std::to_string( task.start_us )
+                     + ",\"dur\":" + std::to_string( task.duration_us )
+                     + ",\"args\":{\"records_in\":" + std::to_string( task.records_in )
+                     + ",\"bytes_in\":" + std::to_string( task.bytes_in )
+                     + ",\"records_out\":" + std::to_string( task.records_out )
+                     + ",\"bytes_out\":" + std::to_string( task.bytes_out ) + "}}" );
+        }
+        
+        out.write( "\n],\"displayTimeUnit\":\"ms\"}\n" );
+        out.close();
+    }
+};
+
+/**
+ * Итог run(): приводится к bool (все ли записи приняты редьюсерами), поэтому
+ * if( mr.run( input ) ) работает как раньше.
+ */
+struct RunResult
+{
+    bool accepted = false;
+    JobMetrics metrics;
+    
+    operator bool() const
+    {
+        return accepted;
+    }
+};
+
+/**
+ * Сборщик метрик одного задания. Задачи отчитываются из своих потоков через TaskScope.
+ * При выключенных метриках все методы пустые.
+ */
+class MetricsRecorder
+{
+public:
+    
+    // замер одной задачи: счётчики заполняет сама задача, отчёт уходит в деструкторе
+    class TaskScope
+    {
+    public:
+    
+        TaskScope( MetricsRecorder& recorder, job_metrics::Phase phase, int index )
+        : recorder( recorder )
+        {
+            if constexpr ( job_metrics::ENABLED )
+            {
+                task.phase = phase;
+                task.index = index;
+                task.thread = job_metrics::thread_number();
+                started = job_metrics::Clock::now();
+            }
+        }
+        
+        TaskScope( const TaskScope& ) = delete;
+        TaskScope& operator=( const TaskScope& ) = delete;
+        
+        ~TaskScope()
+        {
+            if constexpr ( job_metrics::ENABLED )
+            {
+                task.start_us = recorder.since_start( started );
+                task.duration_us = recorder.since_start( job_metrics::Clock::now() ) - task.start_us;
+                recorder.add( task );
+            }
+        }
+        
+        void add_in( uint64_t records, uint64_t bytes )
+        {
+            if constexpr ( job_metrics::ENABLED )
+            {
+                task.records_in += records;
+                task.bytes_in += bytes;
+            }
+        }
+        
+        void add_out( uint64_t records, uint64_t bytes )
+        {
+            if constexpr ( job_metrics::ENABLED )
+            {
+                task.records_out += records;
+                task.bytes_out += bytes;
+            }
+        }
+        
+        const TaskMetrics& task_metrics() const
+        {
+            return task;
+        }
+    
+    private:
+        MetricsRecorder& recorder;
+        TaskMetrics task{};
+        job_metrics::Clock::time_point started;
+    };
+    
+    void start()
+    {
+        if constexpr ( job_metrics::ENABLED )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            tasks.clear();
+            spills = 0;
+            speculative_attempts = 0;
+            speculative_wins = 0;
+            started = job_metrics::Clock::now();
+        }
+    }
+    
+    void add_spills( size_t count )
+    {
+        if constexpr ( job_metrics::ENABLED )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            spills += count;
+        }
+    }
+    
+    void add_speculation( size_t attempts, size_t wins )
+    {
+        if constexpr ( job_metrics::ENABLED )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            speculative_attempts += attempts;
+            speculative_wins += wins;
+        }
+    }
+    
+    // сводка по отчитавшимся задачам
+    JobMetrics finish( int partitions )
+    {
+        JobMetrics metrics;
+        
+        if constexpr ( job_metrics::ENABLED )
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            metrics.wall_us = since_start( job_metrics::Clock::now() );
+            metrics.spills = spills;
+            metrics.speculative_attempts = speculative_attempts;
+            metrics.speculative_wins = speculative_wins;
+            metrics.tasks = std::move( tasks );
+            tasks.clear();
+            
+            std::sort( metrics.tasks.begin(), metrics.tasks.end(),
+                       []( const TaskMetrics& a, const TaskMetrics& b ) { return a.start_us < b.start_us; } );
+            
+            metrics.partition_records.assign( static_cast< size_t >( partitions ), 0 );
+            std::array< std::vector< uint64_t >, job_metrics::PHASES_COUNT > durations;
+            
+            for( const TaskMetrics& task : metrics.tasks )
+            {
+                size_t p = static_cast< size_t >( task.phase );
+                PhaseMetrics& phase = metrics.phases[ p ];
+                uint64_t end = task.start_us + task.duration_us;
+                
+                phase.start_us = phase.tasks ? std::min( phase.start_us, task.start_us ) : task.start_us;
+                phase.end_us = std::max( phase.end_us, end );
+                ++phase.tasks;
+                
+                phase.records_in += task.records_in;
+                phase.bytes_in += task.bytes_in;
+                phase.records_out += task.records_out;
+                phase.bytes_out += task.bytes_out;
+                
+                durations[ p ].push_back( task.duration_us );
+                if( task.duration_us >= phase.max_task_us )
+                {
+                    phase.max_task_us = task.duration_us;
+                    phase.slowest_task = task.index;
+                }
+                
+                // у отменённой копии reduce-задачи записей меньше - берём большую из попыток
+                if( task.phase == job_metrics::Phase::Reduce && task.index >= 0 && task.index < partitions )
+                {
+                    uint64_t& records = metrics.partition_records[ static_cast< size_t >( task.index ) ];
+                    records = std::max( records, task.records_in );
+                }
+            }
+            
+            for( size_t p = 0; p < job_metrics::PHASES_COUNT; ++p )
+            {
+                auto& phase_durations = durations[ p ];
+                if( phase_durations.empty() )
+                    continue;
+                
+                auto median = phase_durations.begin() + phase_durations.size() / 2;
+                std::nth_element( phase_durations.begin(), median, phase_durations.end() );
+                metrics.phases[ p ].median_task_us = *median;
+            }
+            
+            if( metrics.phase( job_metrics::Phase::Reduce ).tasks )
+            {
+                auto largest = std::max_element( metrics.partition_records.begin(), metrics.partition_records.end() );
+                metrics.largest_partition = static_cast< int >( largest - metrics.partition_records.begin() );
+            }
+        }
+        
+        return metrics;
+    }
+    
+private:
+    uint64_t since_start( job_metrics::Clock::time_point time ) const
+    {
+        return static_cast< uint64_t >( std::chrono::duration_cast< std::chrono::microseconds >( time - started ).count() );
+    }
+    
+    void add( const TaskMetrics& task )
+    {
+        std::lock_guard< std::mutex > lock( mutex );
+        tasks.push_back( task );
+    }
+    
+    std::mutex mutex;
+    std::vector< TaskMetrics > tasks;
+    size_t spills = 0;
+    size_t speculative_attempts = 0;
+    size_t speculative_wins = 0;
+    job_metrics::Clock::time_point started;
+};
@@ -0,0 +1,164 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "arena.h"
+#include "record_io.h"
+
+/**
+ * Отсортированная серия в памяти. Строковые ключи - string_view на память арены,
+ * которой серия владеет (одна арена может быть общей для нескольких серий задачи).
+ */
+template< typename Key, typename Value >
+struct SortedRun
+{
+    using Record = std::pair< typename ArenaKey< Key >::View, Value >;
+    
+    std::vector< Record > records;
+    std::shared_ptr< Arena > arena;
+};
+
+/**
+ * Потоковое k-путевое слияние отсортированных серий.
+ * Серии - файлы промежуточных данных и/или уже отсортированные массивы в памяти.
+ *
+ * Держит в памяти только буфер упреждающего чтения и текущую запись на каждую серию,
+ * поэтому память ограничена количеством серий, а не количеством различных ключей.
+ * Одинаковые ключи из разных серий (и подряд идущие в одной серии) суммируются на лету.
+ *
+ *     KWayMerge merge( files );
+ *     for( std::pair< std::string, int > record; merge.next( record ); )
+ *         ...
+ */
+template< typename Key, typename Value >
+class BasicKWayMerge
+{
+public:
+    
+    static constexpr size_t DEFAULT_BUFFER_SIZE = 1 << 20;
+    
+    using Run = SortedRun< Key, Value >;
+    
+    explicit BasicKWayMerge( const std::vector< std::string >& runs,
+                             const std::vector< const Run* >& memory_runs = {},
+                             size_t buffer_size = DEFAULT_BUFFER_SIZE )
+    : heads( runs.size() + memory_runs.size() )
+    {
+        cursors.reserve( heads.size() );
+        for( const auto& run : runs )
+            cursors.emplace_back( run, buffer_size );
+        for( const Run* run : memory_runs )
+            cursors.emplace_back( *run );
+        
+        for( size_t i = 0; i < cursors.size(); ++i )
+        {
+            if( cursors[ i ].read( heads[ i ] ) )
+                heap.push_back( i );
+        }
+        
+        for( size_t i = heap.size() / 2; i-- > 0; )
+            sift_down( i );
+    }
+    
+    // следующая запись в порядке возрастания ключа, false - все серии прочитаны
+    bool next( std::pair< Key, Value >& record )
+    {
+        if( heap.empty() )
+            return false;
+        
+        std::swap( record, heads[ heap[ 0 ] ] ); // обмен, а не копия: буфер ключа переиспользуется
+        advance_top();
+        
+        while( !heap.empty() && heads[ heap[ 0 ] ].first == record.first )
+        {
+            record.second += heads[ heap[ 0 ] ].second;
+            advance_top();
+        }
+        
+        return true;
+    }
+    
+private:
+    // позиция в серии: файл читается через буфер, серия в памяти - по указателю
+    class Cursor
+    {
+    public:
+        
+        Cursor( const std::string& file, size_t buffer_size )
+        : reader( std::in_place, file, buffer_size )
+        {}
+        
+        explicit Cursor( const Run& run )
+        : next( run.records.data() )
+        , end( run.records.data() + run.records.size() )
+        {}
+        
+        bool read( std::pair< Key, Value >& record )
+        {
+            if( reader )
+                return reader->read( record );
+            
+            if( next == end )
+                return false;
+            
+            // строковый ключ копируется в уже выделенный буфер record.first
+            record.first = next->first;
+            record.second = next->second;
+            ++next;
+            return true;
+        }
+        
+    private:
+        std::optional< BasicRecordReader< Key, Value > > reader;
+        const typename Run::Record* next = nullptr;
+        const typename Run::Record* end = nullptr;
+    };
+    
+    // читает следующую запись из серии на вершине кучи и восстанавливает кучу
+    void advance_top()
+    {
+        if( !cursors[ heap[ 0 ] ].read( heads[ heap[ 0 ] ] ) )
+        {
+            heap[ 0 ] = heap.back();
+            heap.pop_back();
+        }
+        
+        if( !heap.empty() )
+            sift_down( 0 );
+    }
+    
+    bool less( size_t a, size_t b ) const
+    {
+        return heads[ heap[ a ] ].first < heads[ heap[ b ] ].first;
+    }
+    
+    void sift_down( size_t i )
+    {
+        for( ;; )
+        {
+            size_t smallest = i;
+            size_t left = 2 * i + 1;
+            size_t right = left + 1;
+            
+            if( left < heap.size() && less( left, smallest ) )
+                smallest = left;
+            if( right < heap.size() && less( right, smallest ) )
+                smallest = right;
+            if( smallest == i )
+                return;
+            
+            std::swap( heap[ i ], heap[ smallest ] );
+            i = smallest;
+        }
+    }
+    
+    std::vector< Cursor > cursors;
+    std::vector< std::pair< Key, Value > > heads;
+    std::vector< size_t > heap;
+};
+
+using KWayMerge = BasicKWayMerge< std::string, int >;
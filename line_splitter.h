@@ -0,0 +1,200 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <istream>
+#include <string>
+#include <string_view>
+#include <type_traits>
+
+#if defined( __GNUC__ ) && ( defined( __x86_64__ ) || ( defined( __i386__ ) && defined( __SSE2__ ) ) )
+#include <immintrin.h>
+#define LINE_SPLITTER_X86 1
+#endif
+
+/**
+ * Поиск границ строк.
+ *
+ * find_newline возвращает указатель на первый '\n' в [first, last) или last, если его нет.
+ * На x86 используется SSE2 или AVX2 (выбирается один раз во время выполнения),
+ * на остальных платформах - memchr.
+ */
+namespace line_splitter_detail
+{
+    inline const char* find_newline_scalar( const char* first, const char* last )
+    {
+        const void* found = std::memchr( first, '\n', static_cast< size_t >( last - first ) );
+        return found ? static_cast< const char* >( found ) : last;
+    }
+    
+#ifdef LINE_SPLITTER_X86
+    inline const char* find_newline_sse2( const char* first, const char* last )
+    {
+        const __m128i nl = _mm_set1_epi8( '\n' );
+        while( last - first >= 16 )
+        {
+            __m128i chunk = _mm_loadu_si128( reinterpret_cast< const __m128i* >( first ) );
+            unsigned mask = static_cast< unsigned >( _mm_movemask_epi8( _mm_cmpeq_epi8( chunk, nl ) ) );
+            if( mask )
+                return first + __builtin_ctz( mask );
+            first += 16;
+        }
+        
+        for( ; first != last; ++first )
+        {
+            if( *first == '\n' )
+                return first;
+        }
+        return last;
+    }
+    
+    __attribute__(( target( "avx2" ) ))
+    inline const char* find_newline_avx2( const char* first, const char* last )
+    {
+        const __m256i nl = _mm256_set1_epi8( '\n' );
+        while( last - first >= 32 )
+        {
+            __m256i chunk = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( first ) );
+            unsigned mask = static_cast< unsigned >( _mm256_movemask_epi8( _mm256_cmpeq_epi8( chunk, nl ) ) );
+            if( mask )
+                return first + __builtin_ctz( mask );
+            first += 32;
+        }
+        
+        return find_newline_sse2( first, last );
+    }
+#endif
+    
+    using FindNewlineFunction = const char* (*)( const char*, const char* );
+    
+    inline FindNewlineFunction select_find_newline()
+    {
+#ifdef LINE_SPLITTER_X86
+        __builtin_cpu_init();
+        if( __builtin_cpu_supports( "avx2" ) )
+            return find_newline_avx2;
+        return find_newline_sse2;
+#else
+        return find_newline_scalar;
+#endif
+    }
+}
+
+inline const char* find_newline( const char* first, const char* last )
+{
+    static const line_splitter_detail::FindNewlineFunction impl = line_splitter_detail::select_find_newline();
+    return impl( first, last );
+}
+
+namespace line_splitter_detail
+{
+    // f может вернуть bool: false останавливает перебор строк
+    template< typename F >
+    bool call( F& f, std::string_view line )
+    {
+        if constexpr ( std::is_same_v< std::invoke_result_t< F&, std::string_view >, bool > )
+            return f( line );
+        else
+        {
+            f( line );
+            return true;
+        }
+    }
+}
+
+/**
+ * Вызывает f для каждой строки блока (без символа '\n').
+ * Семантика совпадает с getline: завершающий '\n' не порождает пустую строку.
+ * Если f возвращает bool, false прекращает перебор.
+ */
+template< typename F >
+void for_each_line( std::string_view block, F&& f )
+{
+    const char* first = block.data();
+    const char* last = first + block.size();
+    
+    while( first != last )
+    {
+        const char* end = find_newline( first, last );
+        if( !line_splitter_detail::call( f, std::string_view( first, static_cast< size_t >( end - first ) ) ) )
+            return;
+        
+        if( end == last )
+            break;
+        first = end + 1;
+    }
+}
+
+/**
+ * То же самое для потока: читает из is ровно count байт окнами по window байт
+ * и вызывает f для каждой строки. Хвост строки, не поместившийся в окно, переносится в следующее.
+ */
+template< typename F >
+void for_each_line( std::istream& is, size_t count, F&& f, size_t window = 1 << 20 )
+{
+    std::string buff;
+    size_t tail = 0; // начало незавершённой строки в buff
+    
+    while( count )
+    {
+        size_t chunk = std::min( count, window );
+        size_t used = buff.size() - tail;
+        
+        buff.erase( 0, tail );
+        buff.resize( used + chunk );
+        is.read( &buff[ used ], static_cast< std::streamsize >( chunk ) );
+        
+        size_t got = static_cast< size_t >( is.gcount() );
+        buff.resize( used + got );
+        count = got == chunk ? count - chunk : 0;
+        
+        const char* first = buff.data();
+        const char* last = first + buff.size();
+        const char* scan = first + used; // в перенесённом хвосте '\n' уже точно нет
+        
+        for( const char* end; ( end = find_newline( scan, last ) ) != last; scan = first )
+        {
+            if( !line_splitter_detail::call( f, std::string_view( first, static_cast< size_t >( end - first ) ) ) )
+                return;
+            first = end + 1;
+        }
+        
+        tail = static_cast< size_t >( first - buff.data() );
+    }
+    
+    if( tail != buff.size() )
+        line_splitter_detail::call( f, std::string_view( buff.data() + tail, buff.size() - tail ) );
+}
+
+/**
+ * Возвращает позицию первого '\n' в файле, начиная с pos, или size, если его нет.
+ * Читает окнами по window байт - один seekg на вызов вместо seekg на каждый байт.
+ */
+inline size_t find_newline( std::istream& is, size_t pos, size_t size, size_t window = 1 << 16 )
+{
+    if( pos >= size )
+        return size;
+    
+    std::string buff( std::min( window, size - pos ), '\0' );
+    is.clear();
+    is.seekg( static_cast< std::streamoff >( pos ), std::ios::beg );
+    
+    while( pos < size )
+    {
+        size_t chunk = std::min( buff.size(), size - pos );
+        is.read( &buff[ 0 ], static_cast< std::streamsize >( chunk ) );
+        
+        size_t got = static_cast< size_t >( is.gcount() );
+        if( !got )
+            break;
+        
+        const char* end = find_newline( buff.data(), buff.data() + got );
+        if( end != buff.data() + got )
+            return pos + static_cast< size_t >( end - buff.data() );
+        
+        pos += got;
+    }
+    
+    return size;
+}
@@ -0,0 +1,100 @@
+#pragma once
+
+#include <cstddef>
+#include <filesystem>
+#include <string_view>
+
+#if defined( __unix__ ) || defined( __APPLE__ )
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define MAPREDUCE_HAS_MMAP 1
+#endif
+
+/**
+ * Входной файл, отображённый в память только для чтения.
+ *
+ * Мапперы получают строки как std::string_view прямо из отображённой области, без копирования.
+ * Если отобразить файл нельзя (нет mmap, пустой файл, pipe и т.п.), valid() возвращает false,
+ * и вызывающий код должен читать файл потоком.
+ */
+class MappedFile
+{
+public:
+    
+    explicit MappedFile( const std::filesystem::path& path )
+    {
+#ifdef MAPREDUCE_HAS_MMAP
+        int fd = ::open( path.c_str(), O_RDONLY );
+        if( fd < 0 )
+            return;
+        
+        struct stat st;
+        if( ::fstat( fd, &st ) == 0 && S_ISREG( st.st_mode ) && st.st_size > 0 )
+        {
+            void* addr = ::mmap( nullptr, static_cast< size_t >( st.st_size ), PROT_READ, MAP_PRIVATE, fd, 0 );
+            if( addr != MAP_FAILED )
+            {
+                ptr = static_cast< const char* >( addr );
+                length = static_cast< size_t >( st.st_size );
+                ::madvise( addr, length, MADV_SEQUENTIAL );
+            }
+        }
+        
+        ::close( fd ); // отображение остаётся валидным и после закрытия дескриптора
+#else
+        (void)path;
+#endif
+    }
+    
+    ~MappedFile()
+    {
+#ifdef MAPREDUCE_HAS_MMAP
+        if( ptr )
+            ::munmap( const_cast< char* >( ptr ), length );
+#endif
+    }
+    
+    MappedFile( const MappedFile& ) = delete;
+    MappedFile& operator=( const MappedFile& ) = delete;
+    
+    bool valid() const
+    {
+        return ptr != nullptr;
+    }
+    
+    const char* data() const
+    {
+        return ptr;
+    }
+    
+    size_t size() const
+    {
+        return length;
+    }
+    
+    std::string_view view( size_t from, size_t to ) const
+    {
+        return std::string_view( ptr + from, to - from );
+    }
+    
+    // просит ядро заранее прочитать [from, to) - страницы подгружаются, пока маппер разбирает начало блока
+    void will_need( size_t from, size_t to ) const
+    {
+#ifdef MAPREDUCE_HAS_MMAP
+        static const size_t page = static_cast< size_t >( ::sysconf( _SC_PAGESIZE ) );
+        
+        size_t start = from / page * page;
+        if( ptr && to > start )
+            ::madvise( const_cast< char* >( ptr ) + start, to - start, MADV_WILLNEED );
+#else
+        (void)from;
+        (void)to;
+#endif
+    }
+    
+private:
+    const char* ptr = nullptr;
+    size_t length = 0;
+};
@@ -1,16 +1,37 @@
 #pragma once
 
+#include <algorithm>
+#include <deque>
 #include <filesystem>
 #include <thread>
 #include <vector>
 #include <iostream>
 #include <fstream>
-#include <math.h>
 #include <sstream>
-#include <map>
 #include <stdexcept>
 #include <future>
 #include <mutex>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <random>
+#include <string_view>
+#include <type_traits>
+
+#include "cancellation.h"
+#include "input_source.h"
+#include "job_metrics.h"
+#include "line_splitter.h"
+#include "kway_merge.h"
+#include "mapped_file.h"
+#include "memory_shuffle.h"
+#include "partitioner.h"
+#include "process_executor.h"
+#include "record_io.h"
+#include "scratch_directory.h"
+#include "sort_combiner.h"
+#include "speculation.h"
+#include "thread_pool.h"
 
 /**
  * Это MapReduce фреймворк.
@@ -38,251 +59,539 @@
  * Лучше сделать что-нибудь, чем застрять на каком-нибудь моменте и не сделать ничего.
  */
 
-using MapperFunction = std::function< std::pair< std::string, int >( const std::string& ) >;
-using ReducerFunction = std::function< bool ( std::pair< std::string, int >& ) >;
+/**
+ * Через Emitter маппер отдаёт пары (ключ, значение) - сколько угодно на одну строку, в том числе ни одной.
+ * Ключ можно передавать любым типом, который умеют партиционер и RecordTraits< Key >
+ * (например, std::string_view для строковых ключей - тогда строка не создаётся).
+ * Пары уходят либо в файлы партиций, либо в таблицы партиций в памяти (см. set_shuffle_memory).
+ */
+template< typename Key, typename Value, typename Partitioner = HashPartitioner >
+class Emitter
+{
+public:
+    
+    Emitter( std::vector< BasicRecordWriter< Key, Value > >& writers, const Partitioner& partitioner )
+    : writers( &writers )
+    , partitions( static_cast< int >( writers.size() ) )
+    , partitioner( partitioner )
+    {}
+    
+    Emitter( PartitionTables< Key, Value >& tables, int partitions, const Partitioner& partitioner )
+    : tables( &tables )
+    , partitions( partitions )
+    , partitioner( partitioner )
+    {}
+    
+    // только собирает ключи в выборку - для партиционеров по диапазонам
+    Emitter( KeySample< Key >& sample, const Partitioner& partitioner )
+    : sample( &sample )
+    , partitions( 1 )
+    , partitioner( partitioner )
+    {}
+    
+    template< typename K >
+    void operator()( const K& key, const Value& value )
+    {
+        if constexpr ( job_metrics::ENABLED )
+            ++emitted;
+        
+        if( sample )
+        {
+            sample->add( key );
+            return;
+        }
+        
+        int partition = partitioner( key, partitions );
+        
+        if( tables )
+            tables->add( partition, key, value );
+        else
+            ( *writers )[ partition ].write( key, value );
+    }
+    
+    // сколько пар отдано (считается, только когда собираются метрики)
+    uint64_t emitted_count() const
+    {
+        return emitted;
+    }
+    
+private:
+    std::vector< BasicRecordWriter< Key, Value > >* writers = nullptr;
+    PartitionTables< Key, Value >* tables = nullptr;
+    KeySample< Key >* sample = nullptr;
+    int partitions;
+    const Partitioner& partitioner;
+    uint64_t emitted = 0;
+};
+
+template< typename Key, typename Value, typename Partitioner = HashPartitioner >
+using MapperFunction = std::function< void ( std::string_view, Emitter< Key, Value, Partitioner >& ) >;
+
+/**
+ * Что редьюсер говорит о записи:
+ *     Continue - всё в порядке, продолжаем;
+ *     Reject   - запись не прошла, результат задачи отрицательный, но данные дочитываем;
+ *     Abort    - результат отрицательный, и продолжать бессмысленно: задача отменяется целиком.
+ * Редьюсер может возвращать и bool: true - Continue, false - Abort.
+ */
+enum class ReduceResult
+{
+    Continue,
+    Reject,
+    Abort
+};
+
+template< typename Key, typename Value >
+using ReducerFunction = std::function< bool ( std::pair< Key, Value >& ) >;
+
 using CombinerFunction = std::function< void ( const std::string&, int ) >;
 
-class MapReduce
+/**
+ * Mapper, Reducer и Partitioner - параметры шаблона, поэтому функторы и лямбды вызываются напрямую
+ * и встраиваются компилятором. Варианты по умолчанию на std::function удобны, когда типы заранее неизвестны.
+ *
+ * Mapper:      void( std::string_view line, Emitter< Key, Value, Partitioner >& emit )
+ * Reducer:     bool( std::pair< Key, Value >& data ) или ReduceResult( std::pair< Key, Value >& data )
+ * Partitioner: int( const K& key, int partitions )
+ */
+template< typename Key,
+          typename Value,
+          typename Mapper = MapperFunction< Key, Value >,
+          typename Reducer = ReducerFunction< Key, Value >,
+          typename Partitioner = HashPartitioner >
+class BasicMapReduce
 {
 public:
     
-    MapReduce( int mappers, int reducers )
+    using Writer = BasicRecordWriter< Key, Value >;
+    
+    // сколько map-задач приходится на один поток-маппер: мелкие задачи балансируются между потоками
+    static constexpr int DEFAULT_TASKS_PER_MAPPER = 8;
+    
+    // блоки меньше этого размера не дробим - накладные расходы на задачу станут заметны
+    static constexpr size_t MIN_TASK_SIZE = 1 << 16;
+    
+    // выборка для партиционера по диапазонам: строк на блок и ключей, остающихся от блока
+    static constexpr int SAMPLE_LINES_PER_TASK = 128;
+    static constexpr size_t SAMPLE_KEYS_PER_TASK = 256;
+    
+    // сколько кусков InputSource на поток пула читается вперёд, пока мапперы заняты
+    static constexpr int TASKS_AHEAD_PER_THREAD = 2;
+    
+    BasicMapReduce( int mappers, int reducers )
     : mappers_count( mappers )
     , reducers_count( reducers )
+    , own_pool( std::make_unique< ThreadPool >( static_cast< size_t >( std::max( mappers, reducers ) ) ) )
+    , pool( *own_pool )
     {}
     
-    void set_mapper( MapperFunction function )
+    /**
+     * Задание на общем пуле потоков: несколько экземпляров с одним пулом выполняют свои run()
+     * одновременно (каждый из своего потока), и задачи всех заданий делят потоки пула.
+     * Пул должен пережить экземпляр. Сам экземпляр, как и раньше, выполняет одно задание за раз.
+     */
+    BasicMapReduce( int mappers, int reducers, ThreadPool& executor )
+    : mappers_count( mappers )
+    , reducers_count( reducers )
+    , pool( executor )
+    {}
+    
+    void set_tasks_per_mapper( int tasks )
     {
-        mapper = function;
+        tasks_per_mapper = std::max( tasks, 1 );
     }
     
+    void set_mapper( Mapper function )
+    {
+        mapper.emplace( std::move( function ) );
+    }
+    
+    // комбайнер обязан оставить файл отсортированным по ключу - на этом построено слияние партиций
     void set_combiner( CombinerFunction function )
     {
         combiner = function;
+        default_combiner = false;
+    }
+    
+    void set_reducer( Reducer function )
+    {
+        reducer.emplace( std::move( function ) );
+    }
+    
+    void set_partitioner( Partitioner function )
+    {
+        partitioner = std::move( function );
+    }
+    
+    /**
+     * Формат промежуточных файлов и выходов редьюсеров: сжатие меняет процессорное время на ввод-вывод.
+     * Front coding применяется к отсортированным сериям, выход мапперов только сжимается.
+     * Встроенный комбайнер получает тот же формат; свой комбайнер выбирает формат сам
+     * (например, SortCombiner( budget, format )) - читатели узнают формат из файла.
+     */
+    void set_record_format( RecordFormat format )
+    {
+        record_format = format;
+        if( default_combiner )
+            combiner = BasicSortCombiner< Key, Value >( BasicSortCombiner< Key, Value >::DEFAULT_MEMORY_BUDGET, format );
+    }
+    
+    /**
+     * Перемешивание в памяти: map-задачи складывают пары в таблицы партиций (одинаковые ключи сразу
+     * суммируются), а в конце задачи отдают редьюсерам отсортированные массивы - без промежуточных файлов.
+     * bytes - бюджет на всё задание; когда он исчерпан, задача сбрасывает свои таблицы на диск
+     * отсортированными сериями, и редьюсеры сливают их вместе с массивами из памяти.
+     * Комбайнер в этом режиме не нужен и не вызывается. 0 - всё через файлы, как раньше.
+     */
+    void set_shuffle_memory( size_t bytes )
+    {
+        shuffle_budget.set_limit( bytes );
+    }
+    
+    /**
+     * Конвейер (по умолчанию): reduce-задача партиции стартует, как только готовы все её входы,
+     * не дожидаясь конца map остальных партиций. false - reduce начинается после всей фазы map.
+     */
+    void set_pipeline( bool enabled )
+    {
+        pipeline = enabled;
+    }
+    
+    /**
+     * Каталог для промежуточных файлов - например, на tmpfs или быстром локальном диске.
+     * По умолчанию - системный временный каталог (TMPDIR).
+     *
+     * Экземпляр создаёт в нём свой каталог с уникальным именем (см. ScratchDirectory), там лежат выходы
+     * редьюсеров (output_files()). Каждое задание пишет промежуточные файлы в собственный подкаталог,
+     * который удаляется в конце задания, даже если оно завершилось исключением; каталог экземпляра
+     * удаляется вместе с экземпляром. Смена каталога удаляет выходы предыдущего запуска.
+     */
+    void set_scratch_directory( std::filesystem::path path )
+    {
+        scratch_root = std::move( path );
+        scratch = ScratchDirectory();
+    }
+    
+    /**
+     * Рабочие процессы вместо потоков: map-задачи вместе с комбайнером выполняются в processes процессах,
+     * которые запуск порождает через fork() и держит до своего конца (см. ProcessExecutor).
+     * Упавший или съевший всю память маппер роняет свой процесс, а не приложение: run() бросает исключение с причиной.
+     * Партиции передаются через файлы, поэтому перемешивание в памяти (set_shuffle_memory) в этом режиме не используется.
+     *
+     * reduce_in_workers - reduce-задачи тоже уходят в процессы. Копия редьюсера тогда живёт в рабочем процессе,
+     * и обратно приходят только вердикт и выходной файл (output_files()): годится для редьюсеров,
+     * которые всё выводят в Writer, а не в общую с вызывающим кодом память.
+     * memory_limit - ограничение адресного пространства каждого процесса в байтах, 0 - без ограничения.
+     * processes = 0 - снова потоки.
+     */
+    void set_worker_processes( int processes, bool reduce_in_workers = false, size_t memory_limit = 0 )
+    {
+        worker_processes = std::max( processes, 0 );
+        worker_reduce = reduce_in_workers;
+        worker_memory_limit = memory_limit;
+    }
+    
+    /**
+     * Закрепляет потоки пула за ядрами с учётом NUMA-узлов (топология - из sysfs, см. CpuTopology и ThreadPool::pin).
+     * Соседние блоки входа достаются потокам одного узла, а буферы и арены задачи, которые она выделяет сама,
+     * оказываются в памяти узла, где их читают и сбрасывают на диск. На машине с одним узлом остаётся
+     * только закрепление за ядрами. Общий пул закрепляется для всех его заданий - в том числе уже выполняющихся:
+     * их новые задачи распределяются по узлам заново. false - снять закрепление. Вызывать между своими запусками.
+     */
+    void set_cpu_affinity( bool enabled )
+    {
+        if( enabled )
+            pool.pin( CpuTopology::detect() );
+        else
+            pool.unpin();
+    }
+    
+    /**
+     * Спекулятивное выполнение: map-задача, которая заметно отстаёт от соседей (см. SpeculativeTasks),
+     * получает вторую попытку на простаивающем потоке. Попытки пишут во временные файлы; выход первой
+     * завершившейся фиксируется переименованием, вторая отменяется. Помогает, когда задача тормозит
+     * не из-за объёма данных, а из-за медленного диска, занятого ядра или неудачного входа маппера.
+     *
+     * speculate_reduce - то же для reduce-задач. Каждая попытка прогоняет по партиции свою копию редьюсера,
+     * поэтому это годится только для редьюсеров без побочных эффектов: их результат - вердикт и выходной файл.
+     * С рабочими процессами (set_worker_processes) и в run_reduce() копии не запускаются.
+     */
+    void set_speculation( bool enabled, bool speculate_reduce = false )
+    {
+        speculation = enabled;
+        speculation_reduce = enabled && speculate_reduce;
+    }
+    
+    /**
+     * После каждого запуска метрики пишутся в path в формате Chrome trace event:
+     * задачи - интервалы на дорожках потоков. Пустой путь выключает запись.
+     * Без сбора метрик (MAPREDUCE_METRICS=0) файл не пишется.
+     */
+    void set_trace_file( std::filesystem::path path )
+    {
+        trace_file = std::move( path );
+    }
+    
+    // отменяет выполняющийся run() из любого потока
+    void cancel()
+    {
+        token.cancel();
     }
     
-    void set_reducer( ReducerFunction function )
+    // то же, что run( input ), и при успехе записывает prefix_length в output
+    RunResult run( const std::filesystem::path& input, const std::filesystem::path& output, int prefix_length )
     {
-        reducer = function;
+        RunResult found = run( input );
+        
+        if( found )
+        {
+            OutputSink output_file( output );
+            output_file.write( std::to_string( prefix_length ) );
+        }
+        
+        return found;
     }
     
-    void run( const std::filesystem::path& input, const std::filesystem::path& output, int prefix_length )
+    /**
+     * Результат приводится к bool: true, если все редьюсеры приняли все записи;
+     * false - если отклонили или задача отменена. В RunResult::metrics - метрики запуска.
+     */
+    RunResult run( const std::filesystem::path& input )
     {
-        auto blocks = split_file( input, mappers_count );
+        token.reset();
+        metrics.start();
+        
+        auto blocks = split_file( input, map_tasks_count( input ) );
 
         if( blocks.empty() )
             throw std::runtime_error( "empty input file" );
         
-        // Создаём mappers_count потоков
-        // В каждом потоке читаем свой блок данных
-        // Применяем к строкам данных функцию mapper
-        // Сортируем результат каждого потока
-        // Результат сохраняется в файловую систему (представляем, что это большие данные)
-        // Каждый поток сохраняет результат в свой файл (представляем, что потоки выполняются на разных узлах)
+        // Если файл удалось отобразить в память, мапперы получают строки прямо из отображения.
+        // Иначе каждая задача читает свой блок построчно.
+        MappedFile mapped( input );
         
-        std::vector< std::string > mapper_files;
-        auto apply_map = [ &input, &mapper_files, this ]( Block block, int thread_num )
+        auto read_block = [ &input, &mapped, &blocks ]( int task_num, auto& map_line )
         {
-            std::ifstream is( input.string(), std::ios::binary );
-            std::string buff( block.to - block.from, '0' );
-            is.seekg( block.from, is.beg );
-            is.read( &buff[0], block.to - block.from );
+            const Block& block = blocks[ task_num ];
             
-            std::istringstream lines;
-            lines.str( buff );
-                      
-            std::ofstream output( mapper_files[ thread_num ] );
-            
-            int idx = 0;
-            for ( std::string line; getline( lines, line ); )
+            if( mapped.valid() )
             {
-                auto res = mapper( line );
-                if( idx++ )
-                    output << "\n";
-                output << res.first << " " << res.second;
-                output.flush();
+                mapped.will_need( block.from, block.to );
+                for_each_line( mapped.view( block.from, block.to ), map_line );
+            }
+            else
+            {
+                std::ifstream is( input.string(), std::ios::binary );
+                is.seekg( block.from, is.beg );
+                
+                for_each_line( is, block.to - block.from, map_line );
             }
-            
-            output.close();
-            
-            combiner( mapper_files[ thread_num ], thread_num );
         };
-
-
-        std::vector< std::thread > threads;
-        for ( int i = 0; i < mappers_count; ++i )
-        {
-            std::stringstream filename_stream;
-            filename_stream << "mapper" << i << ".txt";
-            mapper_files.push_back( filename_stream.str() );
-            threads.emplace_back( apply_map, blocks[ i ], i );
-        }
-
-        for ( auto& th : threads )
-        {
-            if ( th.joinable() )
-                th.join();
-        }
-
-        // Создаём reducers_count новых файлов
-        std::vector< std::string > reducer_files;
-        std::vector< std::ofstream > reducer_write( reducers_count );
-        std::vector< std::ifstream > mappers_read ( mappers_count );
         
-        for( int i = 0; i < reducers_count; ++i )
-        {
-            std::stringstream filename_stream;
-            filename_stream << "reducer" << i << ".txt";
-            reducer_files.push_back( filename_stream.str() );
-            reducer_write[i].open( filename_stream.str() );
-        }
-
-        // находим самый большой файл от мапперов
-        int largest_file_idx = 0;
-        std::uintmax_t largest_file_size =  std::filesystem::file_size( mapper_files[ 0 ] );
-        for( int i = 1; i < static_cast< int >( mapper_files.size() ); ++i )
+        if constexpr ( is_sampling_partitioner< Partitioner, Key >::value )
         {
-            if( largest_file_size < std::filesystem::file_size( mapper_files[i] ) )
+            auto read_sample = [ &input, &mapped, &blocks ]( int task_num, auto& map_line )
             {
-                largest_file_idx = i;
-                largest_file_size =  std::filesystem::file_size( mapper_files[ i ] );
-            }
+                sample_lines( input, mapped, blocks[ task_num ], task_num, map_line );
+            };
+            
+            fit_partitioner( static_cast< int >( blocks.size() ), read_sample );
         }
         
-        for ( int i = 0; i < mappers_count; ++i )
-        {
-            mappers_read[i].open( mapper_files[i] );
-        }
+        std::vector< uint64_t > sizes;
+        for( const Block& block : blocks )
+            sizes.push_back( block.to - block.from );
         
-        // Из mappers_count файлов читаем данные (результат фазы map) и перекладываем в reducers_count (вход фазы reduce)
-        // Перекладываем так, чтобы:
-        //     * данные были отсортированы
-        //     * одинаковые ключи оказывались в одном файле, чтобы одинаковые ключи попали на один редьюсер
-        //     * файлы примерно одинакового размера, чтобы редьюсеры были загружены примерно равномерно
-
-        std::map< std::string, int > merge_data;
+        return finish_run( run_job( static_cast< int >( blocks.size() ), read_block, sizes ) );
+    }
+    
+    /**
+     * Вход из InputSource - файл, каталог, маска файлов или поток (stdin, канал). Map-задачи - куски
+     * примерно одного размера по границам строк: мелкие файлы собираются в один кусок, большие режутся.
+     * Куски ставятся в пул по мере чтения: поток обрабатывается, не дожидаясь своего конца,
+     * а вперёд читается не больше TASKS_AHEAD_PER_THREAD кусков на поток пула.
+     * Партиционеру по диапазонам выборка нужна до map: у файлов она берётся со всех кусков,
+     * у потока - с кусков, прочитанных вперёд, то есть с его начала.
+     */
+    RunResult run( InputSource& source )
+    {
+        token.reset();
+        metrics.start();
         
-        int reducers_idx = 0;
-        while( !mappers_read[ largest_file_idx ].eof() ) // читаем, пока не закончится самый большой файл
+        // для выборки куски перечисляем заранее: у файлов это только диапазоны, сами данные не читаются,
+        // а поток в памяти читается не дальше, чем читался бы вперёд во время map
+        std::vector< InputChunk > listed;
+        size_t listed_next = 0;
+        
+        if constexpr ( is_sampling_partitioner< Partitioner, Key >::value )
         {
-            for ( int i = 0; i < mappers_count; ++i )
+            size_t ahead_limit = TASKS_AHEAD_PER_THREAD * pool.size();
+            for( InputChunk chunk; ( source.seekable() || listed.size() < ahead_limit ) && source.next( chunk ); )
+                listed.push_back( std::move( chunk ) );
+            
+            auto read_sample = [ &listed ]( int task_num, auto& map_line )
             {
-                if( mappers_read[ i ].eof() )
-                    continue;
+                sample_lines( listed[ task_num ].data, task_num, map_line );
                 
-                std::string key;
-                int value;
-                mappers_read[ i ] >> key >> value;
-                
-                merge_data[ key ] += value;
-            }
-            
-            if( merge_data.empty() )
-                break;
-            
-            auto it = merge_data.begin();
-            
-            if( std::filesystem::file_size( reducer_files[ reducers_idx ] ) )
-                reducer_write[ reducers_idx ] << "\n";
-            reducer_write[ reducers_idx ] << it->first << " " << it->second;
-            reducer_write[ reducers_idx ].flush();
-            merge_data.erase(it);
+                for( const auto& piece : listed[ task_num ].pieces )
+                {
+                    MappedFile mapped( piece.file );
+                    sample_lines( piece.file, mapped, Block{ piece.from, piece.to }, task_num, map_line );
+                }
+            };
             
-            reducers_idx = reducers_idx == reducers_count - 1 ? 0 : reducers_idx + 1;
-        }
-        
-        reducers_idx = 0;
-        for( const auto& data : merge_data )
-        {
-            if( std::filesystem::file_size( reducer_files[ reducers_idx ] ) )
-                reducer_write[ reducers_idx ] << "\n";
-            reducer_write[ reducers_idx ] << data.first << " " << data.second;
-            reducer_write[ reducers_idx ].flush();
-            reducers_idx = reducers_idx == reducers_count - 1 ? 0 : reducers_idx + 1;
+            fit_partitioner( static_cast< int >( listed.size() ), read_sample );
         }
         
-        for ( int i = 0; i < mappers_count; ++i )
-        {
-            mappers_read[i].close();
-        }
+        // кусок освобождается, когда его задача отработала; копия задачи, начавшая читать раньше, держит свою ссылку
+        std::mutex chunks_mutex;
+        std::deque< std::shared_ptr< const InputChunk > > chunks;
         
-        for ( int i = 0; i < reducers_count; ++i )
+        auto chunk_at = [ &chunks_mutex, &chunks ]( int task_num )
         {
-            reducer_write[i].close();
-        }
-        
-        // Создаём reducers_count потоков
-        // В каждом потоке читаем свой файл (выход предыдущей фазы)
-        // Применяем к строкам функцию reducer
-        // Результат сохраняется в файловую систему 
-        //             (во многих задачах выход редьюсера - большие данные, хотя в нашей задаче можно написать функцию reduce так, чтобы выход не был большим)
+            std::lock_guard< std::mutex > lock( chunks_mutex );
+            return chunks[ task_num ];
+        };
         
-        auto apply_reduce = [ &reducer_files, this ]( int thread_num ) -> bool
+        auto next_chunk = [ &source, &listed, &listed_next, &chunks_mutex, &chunks, this ]( uint64_t& size )
         {
-            if( !std::filesystem::file_size( reducer_files[ thread_num ] ) )
-                return true;
+            InputChunk chunk;
+            if( listed_next < listed.size() )
+                chunk = std::move( listed[ listed_next++ ] );
+            else if( !source.next( chunk ) )
+                return false;
             
-            std::ifstream reduce_file( reducer_files[ thread_num ] );
-            
-            while( !reduce_file.eof() )
+            // прочитанного из потока у рабочих процессов нет - отдаём им кусок файлом задания
+            if( worker_processes && !chunk.data.empty() )
             {
-                std::pair< std::string, int> data;
-                
-                reduce_file >> data.first >> data.second;
+                std::string file = ( job_dir / ( "input" + std::to_string( chunks.size() ) + ".txt" ) ).string();
+                OutputSink out( file );
+                out.write( chunk.data );
+                out.close();
                 
-                if( !reducer( data ) )
-                    return false;
+                chunk.pieces.push_back( { file, 0, chunk.data.size() } );
+                chunk.data.clear();
             }
             
+            size = chunk.size();
+            std::lock_guard< std::mutex > lock( chunks_mutex );
+            chunks.push_back( std::make_shared< const InputChunk >( std::move( chunk ) ) );
             return true;
         };
         
-        std::vector< std::promise< bool > > accumulate_promise( reducers_count );
-        std::vector< std::future< bool > > accumulate_future( reducers_count );
-
-        std::vector< std::thread > reducer_threads;
-        for ( int i = 0; i < reducers_count; ++i )
+        auto read_chunk = [ &chunk_at ]( int task_num, auto& map_line )
         {
-            accumulate_future[ i ] = std::async( std::launch::async, apply_reduce, i );
-        }
-
-        bool found = true;
-        for ( int i = 0; i < reducers_count; ++i )
+            if( auto chunk = chunk_at( task_num ) )
+                chunk->for_each_line( map_line );
+        };
+        
+        auto chunk_files = [ &chunk_at ]( int task_num )
         {
-            if( !accumulate_future[ i ].get() )
-                found = false;
-        }
+            auto chunk = chunk_at( task_num );
+            return chunk ? chunk->encode() : std::vector< std::string >();
+        };
         
-        for ( auto& th : reducer_threads )
+        auto release_chunk = [ &chunks_mutex, &chunks ]( int task_num )
         {
-            if ( th.joinable() )
-                th.join();
-        }
+            std::lock_guard< std::mutex > lock( chunks_mutex );
+            chunks[ task_num ].reset();
+        };
         
-        if( found )
+        return finish_run( run_job( read_chunk, next_chunk, chunk_files, release_chunk, 0 ) );
+    }
+    
+    /**
+     * Следующий раунд цепочки задач: на вход идут не строки файла, а записи, которые редьюсеры
+     * предыдущего запуска вывели в output_files(). Маппер получает ключ записи вместо строки.
+     * Так раунд k + 1 обрабатывает только то, что осталось нерешённым после раунда k,
+     * не перечитывая исходный файл.
+     */
+    RunResult run_records( const std::vector< std::string >& inputs )
+    {
+        static_assert( std::is_convertible_v< const Key&, std::string_view >, "record input needs string keys" );
+        
+        token.reset();
+        metrics.start();
+        
+        auto read_records = [ &inputs ]( int task_num, auto& map_line )
         {
-            std::ofstream output_file( output.string() );
-            output_file << prefix_length;
+            BasicRecordReader< Key, Value > reader( inputs[ task_num ] );
+            
+            for( std::pair< Key, Value > record; reader.read( record ); )
+            {
+                if( !map_line( std::string_view( record.first ) ) )
+                    return;
+            }
+        };
+        
+        // прогресс map-задачи считается в байтах ключей - он лишь приблизительно доходит до размера файла
+        std::vector< uint64_t > sizes;
+        for( const auto& file : inputs )
+            sizes.push_back( std::filesystem::file_size( file ) );
+        
+        return finish_run( run_job( static_cast< int >( inputs.size() ), read_records, sizes ) );
+    }
+    
+    /**
+     * Раунд цепочки только из фазы reduce: partitions[ r ] - уже отсортированный вход редьюсера r,
+     * обычно output_files() предыдущего запуска с тем же партиционером.
+     * Годится, когда следующий раунд не меняет ключи, а только по-новому их свёртывает:
+     * ни чтения исходных данных, ни map, ни сортировки.
+     */
+    RunResult run_reduce( const std::vector< std::string >& partitions )
+    {
+        if( static_cast< int >( partitions.size() ) != reducers_count )
+            throw std::invalid_argument( "one input per reducer expected" );
+        
+        token.reset();
+        metrics.start();
+        output_generation ^= 1;
+        scratch_path(); // выходы пишутся в каталог экземпляра
+        
+        shuffle.assign( reducers_count, PartitionInput() );
+        for ( int r = 0; r < reducers_count; ++r )
+            shuffle[ r ].files.push_back( partitions[ r ] );
+        
+        // входа для map нет - процессы получают только reduce-задачи
+        auto no_input = []( int, auto& ) { throw std::logic_error( "map task in a reduce-only run" ); };
+        auto workers = start_workers( worker_reduce ? worker_processes : 0, no_input );
+        
+        std::vector< char > accepted( reducers_count, true );
+        {
+            TaskGroup tasks( pool, &token );
+            for ( int r = 0; r < reducers_count; ++r )
+                tasks.run( [ &accepted, &workers, r, this ] { accepted[ r ] = execute_reduce( r, workers.get() ); } );
+            
+            tasks.wait();
         }
+        
+        release_shuffle();
+        
+        return finish_run( all_accepted( accepted ) );
     }
     
-private:
+    /**
+     * Файлы с записями, которые редьюсеры вывели в последнем запуске, - по одному на партицию.
+     * Записи в каждом файле отсортированы по ключу. Файлы пишутся, только если редьюсер принимает
+     * вторым аргументом писателя: ReduceResult( std::pair< Key, Value >& data, Writer& out ).
+     */
+    std::vector< std::string > output_files() const
+    {
+        std::vector< std::string > files;
+        for ( int r = 0; r < reducers_count; ++r )
+            files.push_back( output_file( r, output_generation ) );
+        return files;
+    }
+    
+    // блок входного файла - строки из [from, to)
     struct Block
     {
         size_t from;
         size_t to;
     };
     
-    std::string check_value( std::ifstream& is, size_t pos )
-    {
-        std::string buff( 1,'0' );
-        is.seekg( pos, is.beg );
-        is.read( &buff[0], 1 );
-        
-        return buff;
-    }
-    
-    std::vector<Block> split_file( const std::filesystem::path& file, int blocks_count )
+    // режет файл на blocks_count блоков по границам строк
+    static std::vector< Block > split_file( const std::filesystem::path& file, int blocks_count )
     {
         /**
          * Эта функция не читает весь файл.
@@ -291,6 +600,7 @@ private:
          * Делим размер на количество блоков - получаем границы блоков.
          * Читаем данные только вблизи границ.
          * Выравниваем границы блоков по границам строк.
+         * Для каждой границы делаем один seekg и сканируем окно векторизованным поиском '\n'.
          */
         
         std::vector< Block > blocks;
@@ -299,12 +609,33 @@ private:
             return blocks;
         
         std::uintmax_t whole_size = std::filesystem::file_size( file );
-        int pos_interval = ceil( whole_size / ( blocks_count * 1.0 ) );
-        
-        size_t prev_from = 0;
         
         std::ifstream is( file.string(), std::ios::binary );
+        
+        return split_range( whole_size, blocks_count, [ & ]( size_t pos )
+        {
+            return find_newline( is, pos, whole_size );
+        } );
+    }
     
+    /**
+     * Режет [0, whole_size) на blocks_count блоков.
+     * align( pos ) сдвигает границу с pos вперёд до конца строки и возвращает позицию '\n' (или whole_size).
+     * Файл для этого не нужен, поэтому границы больших размеров проверяются без больших файлов.
+     */
+    template< typename Align >
+    static std::vector< Block > split_range( std::uintmax_t whole_size, int blocks_count, Align align )
+    {
+        std::vector< Block > blocks;
+        
+        if( blocks_count <= 0 )
+            return blocks;
+        
+        // целочисленное деление с округлением вверх: double и int теряют точность и переполняются на файлах в гигабайты
+        std::uintmax_t pos_interval = ( whole_size + blocks_count - 1 ) / blocks_count;
+        
+        size_t prev_from = 0;
+        
         for( int i = 0; i < blocks_count; ++i )
         {
             Block block;
@@ -313,14 +644,9 @@ private:
 
             if( i != blocks_count - 1 )
             {
-                block.to = prev_from + pos_interval;
-                
-                while( check_value( is, block.to ) != "\n" )
-                {
-                    block.to++;
-                }
+                block.to = align( std::min< std::uintmax_t >( prev_from + pos_interval, whole_size ) );
                 
-                prev_from = block.to + 1;
+                prev_from = std::min< size_t >( block.to + 1, whole_size );
             }
             else
             {
@@ -332,11 +658,854 @@ private:
         
         return blocks;
     }
-
+    
+private:
+    // сколько файлов партиции копится до промежуточного слияния
+    static constexpr size_t MERGE_FAN_IN = 16;
+    
+    // ответ рабочего процесса на reduce-задачу
+    static constexpr uint64_t WORKER_ACCEPTED = 1;
+    static constexpr uint64_t WORKER_ABORTED = 2;
+    
+    // редьюсер может выводить записи - тогда у reduce-задачи есть выходной файл
+    static constexpr bool reducer_has_output = std::is_invocable_v< Reducer&, std::pair< Key, Value >&, Writer& >;
+    
+    using ShuffleRun = typename PartitionTables< Key, Value >::Run;
+    
+    using TaskScope = MetricsRecorder::TaskScope;
+    using Phase = job_metrics::Phase;
+    using Attempt = SpeculativeTasks::Attempt;
+    
+    // map_tasks задач с известным заранее входом; task_sizes - его объём, по нему судят об отставании
+    template< typename ReadInput >
+    bool run_job( int map_tasks, ReadInput& read_input, const std::vector< uint64_t >& task_sizes )
+    {
+        int next = 0;
+        auto next_task = [ map_tasks, &task_sizes, &next ]( uint64_t& size )
+        {
+            if( next == map_tasks )
+                return false;
+            size = task_sizes[ next++ ];
+            return true;
+        };
+        
+        auto no_files = []( int ) { return std::vector< std::string >(); };
+        auto keep_input = []( int ) {};
+        
+        return run_job( read_input, next_task, no_files, keep_input, map_tasks );
+    }
+    
+    /**
+     * Задание целиком. Map-задачи нумеруются по порядку, в котором их объявляет next_task( uint64_t& size )
+     * (false - задач больше нет), и ставятся в пул сразу:
+     *     read_input( task, map_line ) - прогоняет строки входа задачи через map_line;
+     *     task_files( task )           - вход для рабочего процесса, если его копия состояния его не знает;
+     *     on_mapped( task )            - вход задачи больше не нужен.
+     * expected_tasks - сколько задач будет, 0 - неизвестно: тогда next_task не зовётся, пока вперёд
+     * поставлено TASKS_AHEAD_PER_THREAD задач на поток пула.
+     */
+    template< typename ReadInput, typename NextTask, typename TaskFiles, typename OnMapped >
+    bool run_job( ReadInput& read_input, NextTask& next_task, TaskFiles& task_files, OnMapped& on_mapped, int expected_tasks )
+    {
+        // промежуточные файлы задания живут в его каталоге и удаляются вместе с ним при любом исходе
+        ScratchDirectory job( scratch_path(), "job-" );
+        job_dir = job.path();
+        
+        // выходы чередуются между двумя поколениями файлов, чтобы следующий раунд
+        // мог читать выход предыдущего, пока пишет свой
+        output_generation ^= 1;
+        
+        // пока задачи поступают, сам источник входа - ещё один производитель каждой партиции
+        shuffle.assign( reducers_count, PartitionInput() );
+        for( auto& input : shuffle )
+            input.pending = 1;
+        shuffle_budget.reset();
+        
+        // Режем вход на map-задачи (их больше, чем потоков) и раздаём их пулу
+        // В каждой задаче читаем свой блок данных
+        // Применяем к строкам данных функцию mapper
+        // Сортируем результат каждого потока
+        // Результат сохраняется в файловую систему (представляем, что это большие данные)
+        // Каждая задача сохраняет результат в свои файлы (представляем, что задачи выполняются на разных узлах),
+        // по одному файлу на каждый редьюсер: партицию ключа выбирает partitioner.
+        // Каждый такой файл сортирует отдельная combine-задача.
+        //
+        // Жёстких границ между фазами нет: отсортированная серия сразу отдаётся своей партиции (deliver),
+        // накопившиеся серии партиции сливаются, пока map ещё идёт, а reduce-задача партиции
+        // стартует, как только готовы все её входы, - не дожидаясь остальных партиций.
+        
+        // процессы порождаются до первой задачи: их копия состояния - уже готовый к map запуск
+        auto workers = start_workers( worker_processes, read_input );
+        
+        // попытки задач для спекулятивного выполнения; задача в рабочем процессе не отменяется, поэтому там без копий
+        std::optional< SpeculativeTasks > map_attempts;
+        std::optional< SpeculativeTasks > reduce_attempts;
+        if( speculation && !workers )
+        {
+            map_attempts.emplace();
+            if( speculation_reduce )
+                reduce_attempts.emplace( std::vector< uint64_t >( reducers_count ) );
+        }
+        
+        std::vector< char > accepted( reducers_count, true );
+        TaskGroup tasks( pool, &token );
+        
+        // попытка reduce-задачи; вердикт партиции записывает только победившая
+        auto reduce_attempt = [ &accepted, &reduce_attempts, this ]( int r, int attempt )
+        {
+            Attempt& tracked = reduce_attempts->attempt( r, attempt );
+            if( token.cancelled() || tracked.cancelled() )
+                return;
+            
+            reduce_attempts->started( r, attempt );
+            TaskScope scope( metrics, Phase::Reduce, r );
+            bool partition_accepted = reduce_partition( r, scope, &tracked );
+            
+            bool won = !tracked.cancelled() && reduce_attempts->commit( r, attempt );
+            if constexpr ( reducer_has_output )
+            {
+                std::string output = output_file( r, output_generation );
+                if( won )
+                    std::filesystem::rename( tracked.file( output ), output );
+                else
+                    std::filesystem::remove( tracked.file( output ) );
+            }
+            
+            if( won )
+                accepted[ r ] = partition_accepted;
+        };
+        
+        auto start_reduce = [ &tasks, &accepted, &workers, &reduce_attempts, &reduce_attempt, this ]( int r )
+        {
+            {
+                std::lock_guard< std::mutex > lock( shuffle_mutex );
+                if( std::exchange( shuffle[ r ].reduce_started, true ) )
+                    return;
+            }
+            
+            if( reduce_attempts )
+            {
+                tasks.run( [ &reduce_attempt, r ] { reduce_attempt( r, 0 ); } );
+                return;
+            }
+            
+            ProcessExecutor* reduce_workers = worker_reduce ? workers.get() : nullptr;
+            tasks.run( [ &accepted, reduce_workers, r, this ] { accepted[ r ] = execute_reduce( r, reduce_workers ); } );
+        };
+        
+        auto on_ready = [ &start_reduce, this ]( int r )
+        {
+            if( pipeline )
+                start_reduce( r );
+        };
+        
+        std::atomic< int > mapped_tasks{ 0 };
+        
+        auto apply_map = [ &read_input, &task_files, &on_mapped, &mapped_tasks, &tasks, &on_ready, &workers, &map_attempts, this ]( int task_num, int attempt )
+        {
+            SpeculativeTasks* attempts = map_attempts ? &*map_attempts : nullptr;
+            if( token.cancelled() || ( attempts && attempts->attempt( task_num, attempt ).cancelled() ) )
+                return;
+            
+            if( attempts )
+                attempts->started( task_num, attempt );
+            TaskScope scope( metrics, Phase::Map, task_num );
+            
+            if( workers )
+            {
+                // рабочий процесс сам прогоняет комбайнер по своим файлам
+                add_counters( scope, workers->execute( { WorkerTask::Map, task_num, task_files( task_num ) } ) );
+                ++mapped_tasks;
+                on_mapped( task_num );
+                
+                for ( int r = 0; r < reducers_count; ++r )
+                    deliver( r, { partition_file( task_num, r ) }, ShuffleRun(), tasks, on_ready );
+                return;
+            }
+            
+            if( shuffle_budget.limit() )
+            {
+                if( map_in_memory( task_num, read_input, tasks, on_ready, scope, attempts, attempt ) )
+                {
+                    ++mapped_tasks;
+                    on_mapped( task_num );
+                }
+                return;
+            }
+            
+            if( !map_to_files( task_num, read_input, scope, attempts, attempt ) )
+                return; // попытку обогнала копия
+            
+            ++mapped_tasks;
+            on_mapped( task_num );
+            
+            // номер для комбайнера уникален среди всех combine-задач запуска
+            for ( int r = 0; r < reducers_count; ++r )
+            {
+                tasks.run( [ &tasks, &on_ready, task_num, r, this ]
+                {
+                    if( token.cancelled() )
+                        return;
+                    
+                    TaskScope scope( metrics, Phase::Combine, task_num );
+                    if constexpr ( job_metrics::ENABLED )
+                        scope.add_in( 0, std::filesystem::file_size( partition_file( task_num, r ) ) );
+                    
+                    combiner( partition_file( task_num, r ), task_num * reducers_count + r );
+                    
+                    if constexpr ( job_metrics::ENABLED )
+                        scope.add_out( 0, std::filesystem::file_size( partition_file( task_num, r ) ) );
+                    deliver( r, { partition_file( task_num, r ) }, ShuffleRun(), tasks, on_ready );
+                } );
+            }
+        };
+        
+        // пока ждём, присматриваем за отстающими: копию ставим, только когда очередь пула пуста -
+        // значит, есть простаивающий поток, и копия не отнимет его у обычных задач
+        std::function< void () > speculate;
+        if( map_attempts )
+        {
+            speculate = [ &tasks, &apply_map, &map_attempts, &reduce_attempt, &reduce_attempts, this ]
+            {
+                if( pool.queued() || token.cancelled() )
+                    return;
+                
+                for( size_t task : map_attempts->stragglers( pool.size() ) )
+                    tasks.run( [ &apply_map, task ] { apply_map( static_cast< int >( task ), 1 ); } );
+                
+                if( reduce_attempts )
+                {
+                    for( size_t r : reduce_attempts->stragglers( pool.size() ) )
+                        tasks.run( [ &reduce_attempt, r ] { reduce_attempt( static_cast< int >( r ), 1 ); } );
+                }
+            };
+        }
+        
+        // входы идут по порядку: непрерывный диапазон задач - потокам одного узла
+        const int ahead_limit = TASKS_AHEAD_PER_THREAD * static_cast< int >( pool.size() );
+        int map_tasks = 0;
+        
+        // источник входа может бросить исключение (файл пропал, ошибка чтения потока), а поставленные задачи
+        // ссылаются на локальные переменные - прежде чем их уничтожать, отменяем задание и дожидаемся задач
+        try
+        {
+            for( uint64_t size = 0; !token.cancelled(); ++map_tasks )
+            {
+                while( !expected_tasks && map_tasks - mapped_tasks >= ahead_limit && !token.cancelled() )
+                {
+                    if( speculate )
+                        speculate();
+                    else if( pool.run_pending_task() )
+                        continue;
+                    std::this_thread::sleep_for( std::chrono::milliseconds( 1 ) );
+                }
+            
+                if( !next_task( size ) )
+                    break;
+            
+                {
+                    std::lock_guard< std::mutex > lock( shuffle_mutex );
+                    for( auto& input : shuffle )
+                        ++input.pending;
+                }
+                if( map_attempts )
+                    map_attempts->add( size );
+            
+                size_t nodes = pool.nodes();
+                int node = static_cast< int >( expected_tasks ? static_cast< size_t >( map_tasks ) * nodes / static_cast< size_t >( expected_tasks )
+                                                              : static_cast< size_t >( map_tasks / tasks_per_mapper ) % nodes );
+                tasks.run( [ &apply_map, i = map_tasks ] { apply_map( i, 0 ); }, node );
+            }
+            
+            // задач больше не будет - источник перестаёт быть производителем партиций
+            for ( int r = 0; r < reducers_count; ++r )
+                deliver( r, {}, ShuffleRun(), tasks, on_ready );
+        }
+        catch( ... )
+        {
+            token.cancel();
+            try
+            {
+                tasks.wait();
+            }
+            catch( ... )
+            {
+            }
+            throw;
+        }
+        
+        // ждём map и всё, что успело запуститься; reduce-задачи, которые ещё не стартовали
+        // (режим без конвейера или пустой вход), запускаем здесь
+        tasks.wait( speculate );
+        
+        if( !token.cancelled() )
+        {
+            for ( int r = 0; r < reducers_count; ++r )
+                start_reduce( r );
+            
+            tasks.wait( speculate );
+        }
+        
+        if( map_attempts )
+        {
+            metrics.add_speculation( map_attempts->launched_count(), map_attempts->wins_count() );
+            if( reduce_attempts )
+                metrics.add_speculation( reduce_attempts->launched_count(), reduce_attempts->wins_count() );
+        }
+        
+        release_shuffle();
+        
+        return !token.cancelled() && all_accepted( accepted );
+    }
+    
+    /**
+     * map-задача с выходом в файлы партиций, по одному на редьюсер. При спекулятивном выполнении (attempts)
+     * попытка пишет во временные файлы и, если закончила первой, переименовывает их на место.
+     * false - попытку обогнала другая, её файлы удалены.
+     */
+    template< typename ReadInput >
+    bool map_to_files( int task_num, ReadInput& read_input, TaskScope& scope, SpeculativeTasks* attempts = nullptr, int attempt = 0 )
+    {
+        Attempt* tracked = attempts ? &attempts->attempt( task_num, attempt ) : nullptr;
+        
+        auto file = [ task_num, tracked, this ]( int r )
+        {
+            return tracked ? tracked->file( partition_file( task_num, r ) ) : partition_file( task_num, r );
+        };
+        
+        {
+            std::vector< Writer > output;
+            for ( int r = 0; r < reducers_count; ++r )
+                output.emplace_back( file( r ), RecordFormat{ record_format.compressed, false } );
+            
+            Emitter< Key, Value, Partitioner > emit( output, partitioner );
+            map_block( task_num, read_input, emit, scope, tracked );
+            
+            for( const auto& writer : output )
+                scope.add_out( 0, writer.bytes_written() );
+            scope.add_out( emit.emitted_count(), 0 );
+        }
+        
+        if( !tracked )
+            return true;
+        
+        bool won = !token.cancelled() && !tracked->cancelled() && attempts->commit( task_num, attempt );
+        for ( int r = 0; r < reducers_count; ++r )
+        {
+            if( won )
+                std::filesystem::rename( file( r ), partition_file( task_num, r ) );
+            else
+                std::filesystem::remove( file( r ) );
+        }
+        return won;
+    }
+    
+    /**
+     * Рабочие процессы запуска, если они нужны (processes > 0). Процесс выполняет задачи в своей копии
+     * этого объекта: map - map_to_files и комбайнер, reduce - reduce_partition по присланным файлам.
+     */
+    template< typename ReadInput >
+    std::unique_ptr< ProcessExecutor > start_workers( int processes, ReadInput& read_input )
+    {
+        if( !processes )
+            return nullptr;
+        
+        auto serve = [ &read_input, this ]( const WorkerTask& task )
+        {
+            MetricsRecorder recorder; // метрики процесса уходят родителю в ответе
+            TaskScope scope( recorder, task.kind == WorkerTask::Map ? Phase::Map : Phase::Reduce, task.index );
+            WorkerReply reply;
+            
+            if( task.kind == WorkerTask::Map )
+            {
+                // вход, который появился уже после fork(), приходит описанием в самой задаче
+                if( task.files.empty() )
+                {
+                    map_to_files( task.index, read_input, scope );
+                }
+                else
+                {
+                    InputChunk chunk = InputChunk::decode( task.files );
+                    auto read_chunk = [ &chunk ]( int, auto& map_line ) { chunk.for_each_line( map_line ); };
+                    map_to_files( task.index, read_chunk, scope );
+                }
+                for ( int r = 0; r < reducers_count; ++r )
+                    combiner( partition_file( task.index, r ), task.index * reducers_count + r );
+            }
+            else
+            {
+                shuffle[ task.index ].files = task.files;
+                bool accepted = reduce_partition( task.index, scope );
+                reply.result = ( accepted ? WORKER_ACCEPTED : 0 ) | ( token.cancelled() ? WORKER_ABORTED : 0 );
+            }
+            
+            const TaskMetrics& counters = scope.task_metrics();
+            reply.counters = { counters.records_in, counters.bytes_in, counters.records_out, counters.bytes_out };
+            return reply;
+        };
+        
+        return std::make_unique< ProcessExecutor >( processes, serve, worker_memory_limit );
+    }
+    
+    static void add_counters( TaskScope& scope, const WorkerReply& reply )
+    {
+        scope.add_in( reply.counters[ 0 ], reply.counters[ 1 ] );
+        scope.add_out( reply.counters[ 2 ], reply.counters[ 3 ] );
+    }
+    
+    // reduce-задача партиции r - здесь или в рабочем процессе; массивы в памяти есть только у этого процесса
+    bool execute_reduce( int r, ProcessExecutor* workers )
+    {
+        TaskScope scope( metrics, Phase::Reduce, r );
+        
+        if( !workers || !shuffle[ r ].runs.empty() )
+            return reduce_partition( r, scope );
+        
+        WorkerReply reply = workers->execute( { WorkerTask::Reduce, r, shuffle[ r ].files } );
+        add_counters( scope, reply );
+        
+        if( reply.result & WORKER_ABORTED )
+            token.cancel();
+        return ( reply.result & WORKER_ACCEPTED ) && !token.cancelled();
+    }
+    
+    // tracked - попытка спекулятивного выполнения: ей сообщается прогресс, и её можно отменить отдельно от задания
+    template< typename ReadInput, typename Emit >
+    void map_block( int task_num, ReadInput& read_input, Emit& emit, TaskScope& scope, Attempt* tracked = nullptr )
+    {
+        uint64_t lines = 0;
+        uint64_t bytes = 0;
+        
+        auto map_line = [ &emit, &lines, &bytes, tracked, this ]( std::string_view line ) -> bool
+        {
+            if constexpr ( job_metrics::ENABLED )
+                ++lines;
+            bytes += line.size() + 1;
+            
+            ( *mapper )( line, emit );
+            
+            if( tracked )
+            {
+                tracked->progress.store( bytes, std::memory_order_relaxed );
+                return !token.cancelled() && !tracked->cancelled();
+            }
+            return !token.cancelled();
+        };
+        
+        read_input( task_num, map_line );
+        scope.add_in( lines, bytes );
+    }
+    
+    // map-задача в режиме перемешивания в памяти: в конце отдаёт редьюсерам отсортированные массивы
+    // при спекулятивном выполнении серии отдаёт только первая закончившая попытка; false - серии не отданы
+    template< typename ReadInput, typename OnReady >
+    bool map_in_memory( int task_num, ReadInput& read_input, TaskGroup& tasks, OnReady& on_ready, TaskScope& scope,
+                        SpeculativeTasks* attempts = nullptr, int attempt = 0 )
+    {
+        Attempt* tracked = attempts ? &attempts->attempt( task_num, attempt ) : nullptr;
+        
+        // файлы сброса не переименовываются - у попыток просто разные имена
+        PartitionTables< Key, Value > tables( reducers_count, shuffle_budget,
+                                              [ task_num, tracked, this ]( int r, int spill )
+                                              {
+                                                  std::string file = spill_file( task_num, r, spill );
+                                                  return tracked ? tracked->file( file ) : file;
+                                              },
+                                              record_format );
+        
+        Emitter< Key, Value, Partitioner > emit( tables, reducers_count, partitioner );
+        map_block( task_num, read_input, emit, scope, tracked );
+        
+        if( token.cancelled() )
+            return false;
+        
+        if( tracked && ( tracked->cancelled() || !attempts->commit( task_num, attempt ) ) )
+        {
+            // память таблиц вернёт их деструктор
+            for( const auto& files : tables.spilled_files() )
+            {
+                for( const auto& file : files )
+                    std::filesystem::remove( file );
+            }
+            return false;
+        }
+        
+        auto runs = tables.seal();
+        
+        // массивы живут до конца задания, поэтому их память остаётся занятой в бюджете до release_shuffle()
+        [[maybe_unused]] size_t in_memory = tables.take_reserved();
+        
+        if constexpr ( job_metrics::ENABLED )
+        {
+            // выход задачи - память массивов и сброшенные на диск серии
+            size_t spills = 0;
+            uint64_t spilled_bytes = 0;
+            for( const auto& files : tables.spilled_files() )
+            {
+                spills += files.size();
+                for( const auto& file : files )
+                    spilled_bytes += std::filesystem::file_size( file );
+            }
+            
+            scope.add_out( emit.emitted_count(), in_memory + spilled_bytes );
+            metrics.add_spills( spills );
+        }
+        
+        for ( int r = 0; r < reducers_count; ++r )
+            deliver( r, tables.spilled_files()[ r ], std::move( runs[ r ] ), tasks, on_ready );
+        return true;
+    }
+    
+    /**
+     * Отсортированные серии одного производителя (map- или combine-задачи) для партиции r.
+     * Когда у партиции набирается MERGE_FAN_IN файлов, а производители ещё работают, файлы сливаются
+     * в один отдельной задачей - редьюсеру останется меньше серий. Когда отчитались все, вызывается on_ready( r ).
+     */
+    template< typename OnReady >
+    void deliver( int r, std::vector< std::string > files, ShuffleRun run, TaskGroup& tasks, OnReady& on_ready )
+    {
+        std::vector< std::string > to_merge;
+        int merge_num = 0;
+        bool ready;
+        {
+            std::lock_guard< std::mutex > lock( shuffle_mutex );
+            PartitionInput& input = shuffle[ r ];
+            
+            input.files.insert( input.files.end(), files.begin(), files.end() );
+            if( !run.records.empty() )
+                input.runs.push_back( std::move( run ) );
+            
+            --input.pending;
+            if( input.pending > 0 && input.files.size() >= MERGE_FAN_IN )
+            {
+                to_merge.swap( input.files );
+                merge_num = input.merges++;
+                ++input.pending; // результат слияния - ещё один вход партиции
+            }
+            
+            ready = input.pending == 0;
+        }
+        
+        if( !to_merge.empty() )
+        {
+            tasks.run( [ &tasks, &on_ready, r, merge_num, files = std::move( to_merge ), this ]
+            {
+                if( token.cancelled() )
+                    return;
+                
+                TaskScope scope( metrics, Phase::Merge, r );
+                if constexpr ( job_metrics::ENABLED )
+                {
+                    for( const auto& file : files )
+                        scope.add_in( 0, std::filesystem::file_size( file ) );
+                }
+                
+                std::string merged = merge_file( r, merge_num );
+                {
+                    BasicKWayMerge< Key, Value > merge( files );
+                    Writer output( merged, record_format );
+                    for( std::pair< Key, Value > record; merge.next( record ); )
+                        output.write( record );
+                    
+                    scope.add_out( output.records_written(), output.bytes_written() );
+                }
+                
+                for( const auto& file : files )
+                    std::filesystem::remove( file );
+                
+                deliver( r, { merged }, ShuffleRun(), tasks, on_ready );
+            } );
+        }
+        
+        if( ready )
+            on_ready( r );
+    }
+    
+    void release_shuffle()
+    {
+        shuffle.clear();
+        shuffle_budget.reset();
+    }
+    
+    /**
+     * Сливает входы партиции r (файлы и массивы в памяти) и прогоняет записи через копию редьюсера.
+     * Попытка спекулятивного выполнения (tracked) выводит записи во временный файл и останавливается, если её отменили.
+     */
+    bool reduce_partition( int r, TaskScope& scope, const Attempt* tracked = nullptr )
+    {
+        // Сливаем партицию из отсортированных серий map-задач, одинаковые ключи при этом суммируются -
+        // все они гарантированно попали в одну партицию.
+        // Применяем к парам функцию reducer
+        // Результат сохраняется в файловую систему 
+        //             (во многих задачах выход редьюсера - большие данные, хотя в нашей задаче можно написать функцию reduce так, чтобы выход не был большим)
+        
+        if constexpr ( job_metrics::ENABLED )
+        {
+            for( const auto& file : shuffle[ r ].files )
+                scope.add_in( 0, std::filesystem::file_size( file ) );
+        }
+        
+        std::vector< const ShuffleRun* > memory_runs;
+        for( const auto& run : shuffle[ r ].runs )
+            memory_runs.push_back( &run );
+        
+        BasicKWayMerge< Key, Value > merge( shuffle[ r ].files, memory_runs );
+        
+        // у каждой reduce-задачи своя копия редьюсера, поэтому он может хранить состояние между записями
+        // (например, предыдущий ключ своей партиции)
+        Reducer task_reducer = *reducer;
+        
+        std::optional< Writer > out;
+        if constexpr ( reducer_has_output )
+        {
+            std::string output = output_file( r, output_generation );
+            out.emplace( tracked ? tracked->file( output ) : output, record_format );
+        }
+        
+        bool accepted = true;
+        uint64_t records = 0;
+        for( std::pair< Key, Value > data; !token.cancelled() && !( tracked && tracked->cancelled() ) && merge.next( data ); )
+        {
+            if constexpr ( job_metrics::ENABLED )
+                ++records;
+            
+            ReduceResult result;
+            if constexpr ( reducer_has_output )
+                result = to_reduce_result( task_reducer( data, *out ) );
+            else
+                result = to_reduce_result( task_reducer( data ) );
+            
+            switch( result )
+            {
+                case ReduceResult::Continue:
+                    break;
+                case ReduceResult::Reject:
+                    accepted = false;
+                    break;
+                case ReduceResult::Abort:
+                    scope.add_in( records, 0 );
+                    token.cancel();
+                    return false;
+            }
+        }
+        
+        scope.add_in( records, 0 );
+        if( out )
+            scope.add_out( out->records_written(), out->bytes_written() );
+        
+        return accepted && !token.cancelled();
+    }
+    
+    // сводит метрики запуска и, если задан trace_file, пишет трассировку
+    RunResult finish_run( bool accepted )
+    {
+        RunResult result{ accepted, metrics.finish( reducers_count ) };
+        
+        if constexpr ( job_metrics::ENABLED )
+        {
+            if( !trace_file.empty() )
+                result.metrics.write_chrome_trace( trace_file );
+        }
+        
+        return result;
+    }
+    
+    static bool all_accepted( const std::vector< char >& accepted )
+    {
+        return std::all_of( accepted.begin(), accepted.end(), []( char ok ) { return ok; } );
+    }
+    
+    static ReduceResult to_reduce_result( ReduceResult result )
+    {
+        return result;
+    }
+    
+    static ReduceResult to_reduce_result( bool result )
+    {
+        return result ? ReduceResult::Continue : ReduceResult::Abort;
+    }
+    
+    /**
+     * Выборка ключей для партиционера: маппер применяется к случайным строкам каждого блока,
+     * ключи блока прореживаются reservoir sampling, а по объединённой выборке партиционер выбирает границы.
+     */
+    template< typename ReadSample >
+    void fit_partitioner( int tasks_count, ReadSample& read_sample )
+    {
+        std::vector< KeySample< Key > > samples;
+        for ( int i = 0; i < tasks_count; ++i )
+            samples.emplace_back( SAMPLE_KEYS_PER_TASK, static_cast< uint64_t >( i ) );
+        
+        TaskGroup sampling( pool, &token );
+        for ( int i = 0; i < tasks_count; ++i )
+        {
+            sampling.run( [ &samples, &read_sample, i, this ]
+            {
+                TaskScope scope( metrics, Phase::Sample, i );
+                Emitter< Key, Value, Partitioner > emit( samples[ i ], partitioner );
+                map_block( i, read_sample, emit, scope );
+                scope.add_out( emit.emitted_count(), 0 );
+            } );
+        }
+        sampling.wait();
+        
+        std::vector< Key > keys;
+        for( auto& sample : samples )
+            std::move( sample.sample().begin(), sample.sample().end(), std::back_inserter( keys ) );
+        
+        partitioner.fit( keys, reducers_count );
+    }
+    
+    // SAMPLE_LINES_PER_TASK строк блока, содержащих случайные позиции (генератор с зерном seed)
+    template< typename F >
+    static void sample_lines( const std::filesystem::path& input, const MappedFile& mapped, const Block& block, int seed, F& f )
+    {
+        size_t size = block.to - block.from;
+        if( !size )
+            return;
+        
+        if( mapped.valid() )
+        {
+            sample_lines( mapped.view( block.from, block.to ), seed, f );
+            return;
+        }
+        
+        // без отображения берём строку, следующую за случайной позицией
+        std::mt19937_64 random( static_cast< uint64_t >( seed ) );
+        std::ifstream is( input.string(), std::ios::binary );
+        std::string line;
+        
+        for( int n = 0; n < SAMPLE_LINES_PER_TASK; ++n )
+        {
+            size_t pos = random() % size;
+            
+            is.clear();
+            is.seekg( static_cast< std::streamoff >( block.from + pos ), is.beg );
+            std::getline( is, line );
+            if( !std::getline( is, line ) || static_cast< size_t >( is.tellg() ) > block.to + 1 )
+                continue;
+            
+            if( !f( std::string_view( line ) ) )
+                return;
+        }
+    }
+    
+    // то же для данных в памяти - отображения файла или куска потока
+    template< typename F >
+    static void sample_lines( std::string_view data, int seed, F& f )
+    {
+        if( data.empty() )
+            return;
+        
+        std::mt19937_64 random( static_cast< uint64_t >( seed ) );
+        
+        for( int n = 0; n < SAMPLE_LINES_PER_TASK; ++n )
+        {
+            size_t pos = random() % data.size();
+            
+            size_t begin = pos ? data.rfind( '\n', pos - 1 ) + 1 : 0; // npos + 1 == 0
+            const char* end = find_newline( data.data() + pos, data.data() + data.size() );
+            if( !f( data.substr( begin, static_cast< size_t >( end - data.data() ) - begin ) ) )
+                return;
+        }
+    }
+    
+    // каталог экземпляра; создаётся при первом обращении
+    const std::filesystem::path& scratch_path()
+    {
+        if( scratch.empty() )
+            scratch = ScratchDirectory( scratch_root.empty() ? std::filesystem::temp_directory_path() : scratch_root );
+        return scratch.path();
+    }
+    
+    // файл, в который map-задача task_idx пишет ключи партиции partition
+    std::string partition_file( int task_idx, int partition ) const
+    {
+        std::stringstream filename_stream;
+        filename_stream << "mapper" << task_idx << "_" << partition << ".bin";
+        return ( job_dir / filename_stream.str() ).string();
+    }
+    
+    // файл, в который map-задача task_idx сбрасывает партицию partition, когда кончился бюджет памяти
+    std::string spill_file( int task_idx, int partition, int spill ) const
+    {
+        std::stringstream filename_stream;
+        filename_stream << "mapper" << task_idx << "_" << partition << "_" << spill << ".bin";
+        return ( job_dir / filename_stream.str() ).string();
+    }
+    
+    // файл, в который сливаются накопившиеся серии партиции partition
+    std::string merge_file( int partition, int merge_num ) const
+    {
+        std::stringstream filename_stream;
+        filename_stream << "merge" << partition << "_" << merge_num << ".bin";
+        return ( job_dir / filename_stream.str() ).string();
+    }
+    
+    // файл, в который reduce-задача partition выводит записи в поколении generation; переживает задание
+    std::string output_file( int partition, int generation ) const
+    {
+        std::stringstream filename_stream;
+        filename_stream << "reducer" << partition << "_" << generation << ".bin";
+        return ( scratch.path() / filename_stream.str() ).string();
+    }
+    
+    // mappers_count * tasks_per_mapper задач, но не мельче MIN_TASK_SIZE и не меньше одной на поток
+    int map_tasks_count( const std::filesystem::path& file ) const
+    {
+        if( !std::filesystem::exists( file ) )
+            return mappers_count;
+        
+        std::uintmax_t by_size = std::filesystem::file_size( file ) / MIN_TASK_SIZE;
+        return static_cast< int >( std::max< std::uintmax_t >( mappers_count,
+                                                              std::min< std::uintmax_t >( by_size, mappers_count * tasks_per_mapper ) ) );
+    }
+    
     int mappers_count;
     int reducers_count;
+    int tasks_per_mapper = DEFAULT_TASKS_PER_MAPPER;
+    int output_generation = 0;
+    
+    std::unique_ptr< ThreadPool > own_pool; // нет, если пул общий
+    ThreadPool& pool;
+    CancellationToken token;
+    
+    std::filesystem::path scratch_root;
+    ScratchDirectory scratch;
+    std::filesystem::path job_dir; // каталог выполняющегося задания
 
-    MapperFunction mapper;
-    CombinerFunction combiner;
-    ReducerFunction reducer;
+    std::optional< Mapper > mapper;
+    CombinerFunction combiner = BasicSortCombiner< Key, Value >();
+    bool default_combiner = true;
+    RecordFormat record_format;
+    std::optional< Reducer > reducer;
+    Partitioner partitioner;
+    
+    bool pipeline = true;
+    
+    MetricsRecorder metrics;
+    std::filesystem::path trace_file;
+    
+    int worker_processes = 0;
+    bool worker_reduce = false;
+    size_t worker_memory_limit = 0;
+    
+    bool speculation = false;
+    bool speculation_reduce = false;
+    
+    // входы партиций текущего задания; под shuffle_mutex, пока производители работают
+    struct PartitionInput
+    {
+        std::vector< std::string > files;
+        std::vector< ShuffleRun > runs;
+        int pending = 0;   // сколько производителей (map-задач и слияний) ещё не отдали серию
+        int merges = 0;
+        bool reduce_started = false;
+    };
+    
+    MemoryBudget shuffle_budget;
+    std::mutex shuffle_mutex;
+    std::vector< PartitionInput > shuffle;
 };
+
+using MapReduce = BasicMapReduce< std::string, int >;
@@ -0,0 +1,219 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "arena.h"
+#include "kway_merge.h"
+#include "record_io.h"
+
+/**
+ * Бюджет памяти задачи, общий для всех её потоков.
+ * Резервирование не блокирует: если места нет, try_reserve возвращает false,
+ * и вызывающий сам решает, что сбросить на диск.
+ */
+class MemoryBudget
+{
+public:
+    
+    explicit MemoryBudget( size_t limit = 0 )
+    : max_bytes( limit )
+    {}
+    
+    void set_limit( size_t limit )
+    {
+        max_bytes = limit;
+    }
+    
+    size_t limit() const
+    {
+        return max_bytes;
+    }
+    
+    size_t in_use() const
+    {
+        return used.load( std::memory_order_relaxed );
+    }
+    
+    bool try_reserve( size_t bytes )
+    {
+        size_t current = used.load( std::memory_order_relaxed );
+        do
+        {
+            if( current + bytes > max_bytes )
+                return false;
+        }
+        while( !used.compare_exchange_weak( current, current + bytes, std::memory_order_relaxed ) );
+        
+        return true;
+    }
+    
+    // резервирует без проверки лимита - когда память уже занята и её надо просто учесть
+    void force_reserve( size_t bytes )
+    {
+        used.fetch_add( bytes, std::memory_order_relaxed );
+    }
+    
+    void release( size_t bytes )
+    {
+        used.fetch_sub( bytes, std::memory_order_relaxed );
+    }
+    
+    void reset()
+    {
+        used.store( 0, std::memory_order_relaxed );
+    }
+    
+private:
+    std::atomic< size_t > used{ 0 };
+    size_t max_bytes;
+};
+
+/**
+ * Выход одной map-задачи в памяти: по хеш-таблице на партицию, одинаковые ключи сразу суммируются.
+ *
+ * Ключи и узлы таблиц лежат в арене задачи, так что запись не выделяет память из кучи.
+ * Когда арене нужен новый блок, он берётся из общего бюджета. Если бюджет кончился,
+ * все таблицы задачи сбрасываются на диск отсортированными сериями (файлы дают spill_file),
+ * и арена начинается заново в тех же блоках - так бюджет превышается не больше чем на блок на задачу.
+ * В конце seal() превращает таблицы в отсортированные серии, которые редьюсеры сливают напрямую,
+ * без файлов; арена переходит к сериям.
+ */
+template< typename Key, typename Value >
+class PartitionTables
+{
+public:
+    
+    using Run = SortedRun< Key, Value >;
+    using SpillFileFunction = std::function< std::string ( int partition, int spill ) >;
+    
+    PartitionTables( int partitions, MemoryBudget& budget, SpillFileFunction spill_file, RecordFormat format = RecordFormat() )
+    : partitions( partitions )
+    , spilled( static_cast< size_t >( partitions ) )
+    , budget( budget )
+    , spill_file( std::move( spill_file ) )
+    , format( format )
+    , arena( std::make_shared< Arena >() )
+    {
+        make_tables();
+    }
+    
+    ~PartitionTables()
+    {
+        tables.clear();
+        budget.release( reserved );
+    }
+    
+    PartitionTables( const PartitionTables& ) = delete;
+    PartitionTables& operator=( const PartitionTables& ) = delete;
+    
+    template< typename K >
+    void add( int partition, const K& key, const Value& value )
+    {
+        auto& table = tables[ partition ];
+        
+        View view = ArenaKey< Key >::view( key );
+        auto it = table.find( view );
+        if( it != table.end() )
+        {
+            it->second += value;
+            return;
+        }
+        
+        table.emplace( ArenaKey< Key >::store( *arena, view ), value );
+        
+        if( arena->capacity() > reserved )
+        {
+            size_t bytes = arena->capacity() - reserved;
+            reserved = arena->capacity();
+            
+            if( !budget.try_reserve( bytes ) )
+            {
+                budget.force_reserve( bytes );
+                spill();
+            }
+        }
+    }
+    
+    // отсортированные серии по партициям; их память остаётся в бюджете, её возвращает take_reserved()
+    std::vector< Run > seal()
+    {
+        std::vector< Run > runs( tables.size() );
+        for( size_t p = 0; p < tables.size(); ++p )
+        {
+            runs[ p ].records = sorted_records( tables[ p ] );
+            runs[ p ].arena = arena;
+        }
+        
+        make_tables();
+        return runs;
+    }
+    
+    // сколько байт бюджета занимают данные задачи; после вызова за их возврат отвечает вызывающий
+    size_t take_reserved()
+    {
+        return std::exchange( reserved, 0 );
+    }
+    
+    // файлы, сброшенные на диск, по партициям
+    const std::vector< std::vector< std::string > >& spilled_files() const
+    {
+        return spilled;
+    }
+    
+private:
+    using View = typename ArenaKey< Key >::View;
+    using Table = std::unordered_map< View, Value, std::hash< View >, std::equal_to< View >,
+                                      ArenaAllocator< std::pair< const View, Value > > >;
+    
+    // новые пустые таблицы; старые уничтожаются до того, как их память в арене будет переиспользована
+    void make_tables()
+    {
+        tables.clear();
+        for( int p = 0; p < partitions; ++p )
+            tables.emplace_back( 0, std::hash< View >(), std::equal_to< View >(), ArenaAllocator< std::pair< const View, Value > >( arena.get() ) );
+    }
+    
+    static std::vector< typename Run::Record > sorted_records( const Table& table )
+    {
+        std::vector< typename Run::Record > records( table.begin(), table.end() );
+        std::sort( records.begin(), records.end(), []( const auto& a, const auto& b ) { return a.first < b.first; } );
+        return records;
+    }
+    
+    void spill()
+    {
+        for( size_t p = 0; p < tables.size(); ++p )
+        {
+            if( tables[ p ].empty() )
+                continue;
+            
+            spilled[ p ].push_back( spill_file( static_cast< int >( p ), spills ) );
+            
+            BasicRecordWriter< Key, Value > output( spilled[ p ].back(), format );
+            for( const auto& record : sorted_records( tables[ p ] ) )
+                output.write( record.first, record.second );
+        }
+        
+        ++spills;
+        make_tables();
+        arena->reset();
+    }
+    
+    int partitions;
+    std::vector< Table > tables;
+    std::vector< std::vector< std::string > > spilled;
+    MemoryBudget& budget;
+    SpillFileFunction spill_file;
+    RecordFormat format;
+    
+    std::shared_ptr< Arena > arena;
+    size_t reserved = 0;
+    int spills = 0;
+};
@@ -0,0 +1,261 @@
+#pragma once
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "async_io.h"
+#include "block_codec.h"
+
+/**
+ * Буферизованный приёмник для всех писателей фреймворка.
+ *
+ * Данные копятся в пользовательском буфере и уходят в файл одним fwrite, когда буфер заполнен
+ * или при явном flush(). Никаких системных вызовов на каждую запись.
+ * Нужен ли разделитель перед очередной записью, sink помнит сам (separate()),
+ * вместо того чтобы спрашивать размер файла у файловой системы.
+ *
+ * Файлы, открытые по пути, пишутся с отложенной записью: заполненный буфер уходит на запись асинхронно
+ * (AsyncFile), а данные копятся во втором буфере. Ошибка такой записи выбрасывается из следующей записи,
+ * flush() или close().
+ *
+ * После set_compressed( true ) каждый сброс буфера уходит в файл сжатым блоком (block_codec.h):
+ *     4 байта  размер данных блока, little-endian
+ *     4 байта  размер сжатых данных; 0 - блок не сжался и хранится как есть
+ *     данные
+ */
+class OutputSink
+{
+public:
+    
+    static constexpr size_t DEFAULT_BUFFER_SIZE = 1 << 20;
+    
+    explicit OutputSink( const std::filesystem::path& path, size_t buffer_size = DEFAULT_BUFFER_SIZE )
+    : file( std::fopen( path.string().c_str(), "wb" ) )
+    , owned( true )
+    {
+        if( !file )
+            throw std::runtime_error( "can't open " + path.string() );
+        
+        std::setvbuf( file, nullptr, _IONBF, 0 ); // буферизуем сами
+        buff.reserve( buffer_size );
+        
+        in_flight.reserve( buffer_size );
+        async = std::make_unique< AsyncFile >( ::fileno( file ) );
+    }
+    
+    // пишет в уже открытый файл (например, stdout), не закрывая его
+    explicit OutputSink( std::FILE* stream, size_t buffer_size = DEFAULT_BUFFER_SIZE )
+    : file( stream )
+    , owned( false )
+    {
+        buff.reserve( buffer_size );
+    }
+    
+    OutputSink( OutputSink&& other ) noexcept
+    : file( other.file )
+    , owned( other.owned )
+    , buff( std::move( other.buff ) )
+    , written( other.written )
+    , compressed( other.compressed )
+    , packed( std::move( other.packed ) )
+    , async( std::move( other.async ) )
+    , in_flight( std::move( other.in_flight ) )
+    , offset( other.offset )
+    {
+        other.file = nullptr;
+    }
+    
+    OutputSink( const OutputSink& ) = delete;
+    OutputSink& operator=( const OutputSink& ) = delete;
+    OutputSink& operator=( OutputSink&& ) = delete;
+    
+    ~OutputSink()
+    {
+        try
+        {
+            close();
+        }
+        catch( const std::exception& )
+        {
+        }
+    }
+    
+    void write( const char* data, size_t size )
+    {
+        written += size;
+        
+        if( buff.size() + size > buff.capacity() )
+        {
+            flush_buffer();
+            if( size >= buff.capacity() )
+            {
+                if( !compressed )
+                {
+                    put( data, size );
+                    return;
+                }
+                
+                // сжатые блоки не длиннее буфера - столько же выделяет под блок читатель
+                for( ; size >= buff.capacity(); data += buff.capacity(), size -= buff.capacity() )
+                    put_block( data, buff.capacity() );
+            }
+        }
+        
+        buff.insert( buff.end(), data, data + size );
+    }
+    
+    void write( std::string_view data )
+    {
+        write( data.data(), data.size() );
+    }
+    
+    // пишет разделитель, если до этого уже что-то было записано
+    void separate( char separator = '\n' )
+    {
+        if( written )
+            write( &separator, 1 );
+    }
+    
+    // всё, что записано после вызова, сжимается блоками
+    void set_compressed( bool enabled )
+    {
+        flush_buffer();
+        compressed = enabled;
+    }
+    
+    void flush()
+    {
+        flush_buffer();
+        wait_in_flight();
+        
+        if( file && !async )
+            std::fflush( file );
+    }
+    
+    void close()
+    {
+        if( !file )
+            return;
+        
+        try
+        {
+            flush();
+        }
+        catch( ... )
+        {
+            release();
+            throw;
+        }
+        release();
+    }
+    
+    size_t bytes_written() const
+    {
+        return written;
+    }
+    
+private:
+    void release()
+    {
+        async.reset();
+        if( owned )
+            std::fclose( file );
+        file = nullptr;
+    }
+    
+    void flush_buffer()
+    {
+        if( buff.empty() )
+            return;
+        
+        if( compressed )
+            put_block( buff.data(), buff.size() );
+        else if( async )
+            write_behind( buff );
+        else
+            put( buff.data(), buff.size() );
+        buff.clear();
+    }
+    
+    // отдаёт bytes на асинхронную запись; bytes получает взамен освободившийся буфер
+    void write_behind( std::vector< char >& bytes )
+    {
+        wait_in_flight();
+        
+        std::swap( bytes, in_flight );
+        bytes.clear();
+        
+        async->start_write( in_flight.data(), in_flight.size(), offset );
+        offset += in_flight.size();
+    }
+    
+    void wait_in_flight()
+    {
+        if( async && async->pending() && async->wait() < 0 )
+            throw std::runtime_error( "write failed" );
+    }
+    
+    void put( const char* data, size_t size )
+    {
+        if( async )
+        {
+            wait_in_flight();
+            async->start_write( data, size, offset );
+            offset += size;
+            wait_in_flight();
+            return;
+        }
+        
+        if( std::fwrite( data, 1, size, file ) != size )
+            throw std::runtime_error( "write failed" );
+    }
+    
+    void put_block( const char* data, size_t size )
+    {
+        if( async )
+            wait_in_flight(); // packed может быть ещё в полёте
+        
+        packed.resize( 8 + block_codec::compress_bound( size ) );
+        size_t packed_size = block_codec::compress( data, size, packed.data() + 8 );
+        bool stored = packed_size >= size;
+        if( stored )
+        {
+            std::memcpy( packed.data() + 8, data, size );
+            packed_size = size;
+        }
+        
+        put_uint32( packed.data(), size );
+        put_uint32( packed.data() + 4, stored ? 0 : packed_size );
+        packed.resize( 8 + packed_size );
+        
+        if( async )
+            write_behind( packed );
+        else
+            put( packed.data(), packed.size() );
+    }
+    
+    static void put_uint32( char* out, size_t value )
+    {
+        for( int i = 0; i < 4; ++i )
+            out[ i ] = static_cast< char >( ( value >> ( 8 * i ) ) & 0xff );
+    }
+    
+    std::FILE* file;
+    bool owned;
+    std::vector< char > buff;
+    size_t written = 0;
+    
+    bool compressed = false;
+    std::vector< char > packed;
+    
+    // отложенная запись: буфер в полёте и смещение следующей записи
+    std::unique_ptr< AsyncFile > async;
+    std::vector< char > in_flight;
+    uint64_t offset = 0;
+};
@@ -0,0 +1,225 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <random>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/**
+ * Партиционер решает, на какой редьюсер попадёт ключ.
+ * Получает ключ и количество партиций, возвращает номер партиции в [0, partitions).
+ * Одинаковые ключи обязаны попадать в одну партицию.
+ */
+template< typename Key >
+using PartitionerFunction = std::function< int ( const Key&, int ) >;
+
+/**
+ * Партиционер по умолчанию.
+ * Строковые ключи (всё, что приводится к std::string_view) хешируются FNV-1a по байтам,
+ * поэтому std::string и string_view с одинаковым содержимым попадают в одну партицию.
+ * Остальные типы - через std::hash. В обоих случаях с финальным перемешиванием.
+ */
+struct HashPartitioner
+{
+    static uint64_t hash( std::string_view key )
+    {
+        uint64_t h = 14695981039346656037ull;
+        for( unsigned char c : key )
+        {
+            h ^= c;
+            h *= 1099511628211ull;
+        }
+        return mix( h );
+    }
+    
+    // перемешиваем старшие биты в младшие, иначе для коротких ключей распределение хуже
+    static uint64_t mix( uint64_t h )
+    {
+        h ^= h >> 33;
+        h *= 0xff51afd7ed558ccdull;
+        h ^= h >> 33;
+        return h;
+    }
+    
+    template< typename K >
+    int operator()( const K& key, int partitions ) const
+    {
+        uint64_t h;
+        if constexpr ( std::is_convertible_v< const K&, std::string_view > )
+            h = hash( std::string_view( key ) );
+        else
+            h = mix( std::hash< K >()( key ) );
+        
+        return static_cast< int >( h % static_cast< uint64_t >( partitions ) );
+    }
+};
+
+/**
+ * Равномерная выборка ключей фиксированного размера из потока неизвестной длины (reservoir sampling).
+ * Генератор с фиксированным зерном - выборка, а значит и границы партиций, воспроизводимы.
+ */
+template< typename Key >
+class KeySample
+{
+public:
+    
+    explicit KeySample( size_t capacity, uint64_t seed = 0 )
+    : capacity( capacity )
+    , random( seed )
+    {}
+    
+    template< typename K >
+    void add( const K& key )
+    {
+        ++seen;
+        if( keys.size() < capacity )
+        {
+            keys.emplace_back( key );
+            return;
+        }
+        
+        uint64_t slot = random() % seen;
+        if( slot < capacity )
+            keys[ slot ] = Key( key );
+    }
+    
+    std::vector< Key >& sample()
+    {
+        return keys;
+    }
+    
+private:
+    size_t capacity;
+    size_t seen = 0;
+    std::mt19937_64 random;
+    std::vector< Key > keys;
+};
+
+/**
+ * Партиционер по диапазонам ключей: партиция i получает ключи из ( bounds[ i - 1 ], bounds[ i ] ],
+ * поэтому ключи партиции i меньше ключей партиции i + 1 и выходы редьюсеров, склеенные по порядку,
+ * отсортированы целиком.
+ *
+ * Границы выбирает fit() по выборке ключей так, чтобы на партицию приходилась примерно равная доля выборки.
+ * Тяжёлый ключ - тот, что сам занимает долю выборки не меньше доли партиции, - получает отдельную
+ * партицию, и его соседи по порядку расходятся по другим редьюсерам, а не копятся вместе с ним.
+ * BasicMapReduce вызывает fit() сам перед фазой map, собрав выборку с блоков входа.
+ * Пока fit() не вызван, все ключи попадают в партицию 0.
+ */
+template< typename Key >
+class RangePartitioner
+{
+public:
+    
+    void fit( std::vector< Key >& sample, int partitions )
+    {
+        bounds.clear();
+        if( sample.empty() || partitions < 2 )
+            return;
+        
+        std::sort( sample.begin(), sample.end() );
+        
+        size_t share = std::max< size_t >( sample.size() / static_cast< size_t >( partitions ), 1 );
+        size_t max_bounds = static_cast< size_t >( partitions - 1 );
+        size_t taken = 0; // элементов выборки в текущем диапазоне
+        
+        for( size_t i = 0; i < sample.size() && bounds.size() < max_bounds; )
+        {
+            size_t next = static_cast< size_t >( std::upper_bound( sample.begin() + i, sample.end(), sample[ i ] ) - sample.begin() );
+            size_t count = next - i;
+            
+            // тяжёлый ключ: закрываем текущий диапазон перед ним, сам он займёт отдельный
+            if( count >= share && taken > 0 )
+            {
+                bounds.push_back( sample[ i - 1 ] );
+                taken = 0;
+                if( bounds.size() == max_bounds )
+                    break;
+            }
+            
+            taken += count;
+            if( taken >= share )
+            {
+                bounds.push_back( sample[ next - 1 ] );
+                taken = 0;
+            }
+            
+            i = next;
+        }
+    }
+    
+    template< typename K >
+    int operator()( const K& key, int partitions ) const
+    {
+        auto it = std::lower_bound( bounds.begin(), bounds.end(), key );
+        return std::min( static_cast< int >( it - bounds.begin() ), partitions - 1 );
+    }
+    
+    // верхние границы партиций; партиция после последней границы открыта справа
+    const std::vector< Key >& split_points() const
+    {
+        return bounds;
+    }
+    
+private:
+    std::vector< Key > bounds;
+};
+
+/**
+ * Партиционер, сохраняющий порядок строковых ключей и не разделяющий ключи с общим первым байтом:
+ * ключи партиции i меньше ключей партиции i + 1, а ключи из разных партиций не имеют общего префикса.
+ * Партиции - диапазоны первых байтов, которые fit() выбирает по выборке ключей так же, как RangePartitioner,
+ * поэтому текст из одних латинских букв делится между редьюсерами, а не попадает на один.
+ * Пока fit() не вызван, все ключи попадают в партицию 0.
+ */
+class FirstBytePartitioner
+{
+public:
+    
+    template< typename K >
+    void fit( std::vector< K >& sample, int partitions )
+    {
+        std::vector< unsigned char > bytes;
+        bytes.reserve( sample.size() );
+        for( const K& key : sample )
+            bytes.push_back( first_byte( key ) );
+        
+        ranges.fit( bytes, partitions );
+    }
+    
+    int operator()( std::string_view key, int partitions ) const
+    {
+        return ranges( first_byte( key ), partitions );
+    }
+    
+    // верхние границы партиций - первые байты
+    const std::vector< unsigned char >& split_points() const
+    {
+        return ranges.split_points();
+    }
+    
+private:
+    static unsigned char first_byte( std::string_view key )
+    {
+        return key.empty() ? 0 : static_cast< unsigned char >( key[ 0 ] );
+    }
+    
+    RangePartitioner< unsigned char > ranges;
+};
+
+// партиционер, которому перед запуском нужна выборка ключей (есть fit( std::vector< Key >&, int ))
+template< typename Partitioner, typename Key, typename = void >
+struct is_sampling_partitioner : std::false_type
+{
+};
+
+template< typename Partitioner, typename Key >
+struct is_sampling_partitioner< Partitioner, Key,
+                                std::void_t< decltype( std::declval< Partitioner& >().fit( std::declval< std::vector< Key >& >(), 0 ) ) > >
+: std::true_type
+{
+};
@@ -0,0 +1,243 @@
+#pragma once
+
+#include "mapreduce.h"
+#include "sort_combiner.h"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+
+/**
+ * В этом файле находится клиентский код, который использует наш MapReduce фреймворк.
+ * Этот код знает о том, какую задачу мы решаем.
+ * Задача этого кода - верно написать мапер, редьюсер, запустить mapreduce задачу, обработать результат.
+ * Задача - найти минимальную длину префикса, который позволяет однозначно идентифицировать строку в файле.
+ *
+ * По умолчанию задача решается за один запуск:
+ * маппер отдаёт строки целиком, партиционер по диапазонам (границы - по выборке строк) сохраняет порядок ключей
+ * и делит строки между редьюсерами поровну, даже если почти все они начинаются одинаково.
+ * Каждый редьюсер считает длину общего префикса (LCP) соседних строк своей партиции
+ * и запоминает её первую и последнюю строку - LCP соседей через границу партиций считается после запуска.
+ * Ответ - max( LCP ) + 1. Одинаковые строки никаким префиксом не различить - тогда ответа нет.
+ *
+ * Вход - файл, каталог (все файлы в нём), маска ("*.txt") или "-" - стандартный ввод (см. InputSource).
+ * Стандартный ввод не перечитать, поэтому границы партиций для него выбираются по его началу.
+ *
+ * Параметры после количества редьюсеров, в любом порядке:
+ *     compress  - сжимать промежуточные файлы (см. RecordFormat), когда упираемся в диск, а не в процессор;
+ *     processes - мапперы работают в отдельных процессах (см. set_worker_processes): упавший маппер
+ *                 не роняет программу; в варианте rounds в процессах работают и редьюсеры;
+ *     affinity  - потоки закреплены за ядрами с учётом NUMA-узлов (см. set_cpu_affinity);
+ *     rounds    - вариант в несколько запусков, причём каждый следующий раунд
+ *                получает на вход только строки, ещё не различимые на предыдущем (см. run_reduce):
+ * 
+ * Как предлагаю делать я:
+ * Выделяем первые буквы слов (в мапере), решаем для них задачу "определить, есть ли в них повторы".
+ * Если не прокатило, повторяем процедуру, выделяя первые две буквы.
+ * И т.д. В итоге найдём длину префикса, который однозначно определяет строку.
+ * 
+ * Здесь описано то, как я примерно решал бы задачу, это не руководство к действию, а просто пояснение к основному тексту задания.
+ * Вы можете поступать по-своему (не как я описываю), задание творческое!
+ * Можете делать так, как написано, если считаете, что это хорошо.
+ */
+
+inline constexpr int MAX_PREFIX_LENGTH = 256;
+
+// пока промежуточные данные помещаются в этот бюджет, они не попадают на диск
+inline constexpr size_t SHUFFLE_MEMORY = 256 << 20;
+
+using PrefixCombiner = BasicSortCombiner< std::string, int64_t >;
+
+struct LineMapper
+{
+    template< typename Emit >
+    void operator()( std::string_view line, Emit& emit ) const
+    {
+        emit( line, 1 );
+    }
+};
+
+inline size_t common_prefix( const std::string& a, const std::string& b )
+{
+    auto mismatch = std::mismatch( a.begin(), a.end(), b.begin(), b.end() );
+    return static_cast< size_t >( mismatch.first - a.begin() );
+}
+
+// первая и последняя строка партиции
+using PartitionEdges = std::pair< std::string, std::string >;
+
+struct AdjacentLcpReducer
+{
+    AdjacentLcpReducer( std::atomic< size_t >& result, std::deque< PartitionEdges >& edges, std::mutex& edges_mutex )
+    : max_lcp( &result )
+    , all_edges( &edges )
+    , all_edges_mutex( &edges_mutex )
+    {}
+    
+    ReduceResult operator()( std::pair< std::string, int64_t >& data )
+    {
+        if( data.second > 1 ) // одинаковые строки
+            return ReduceResult::Abort;
+        
+        if( edges )
+        {
+            size_t lcp = common_prefix( edges->second, data.first );
+            
+            size_t current = max_lcp->load();
+            while( current < lcp && !max_lcp->compare_exchange_weak( current, lcp ) )
+            {
+            }
+        }
+        else
+        {
+            // первая строка партиции; deque не перемещает элементы, так что указатель останется верным
+            std::lock_guard< std::mutex > lock( *all_edges_mutex );
+            edges = &all_edges->emplace_back( data.first, std::string() );
+        }
+        
+        edges->second = data.first; // предыдущая строка для следующего вызова
+        return ReduceResult::Continue;
+    }
+    
+private:
+    std::atomic< size_t >* max_lcp; // общий для всех reduce-задач
+    std::deque< PartitionEdges >* all_edges;
+    std::mutex* all_edges_mutex;
+    
+    PartitionEdges* edges = nullptr;
+};
+
+// обычный файл режется на куски как раньше; каталог, маска и поток читаются через InputSource
+template< typename MapReduce >
+inline bool run_input( MapReduce& mr, const std::filesystem::path& input )
+{
+    if( input == "-" )
+    {
+        InputSource source( stdin );
+        return mr.run( source );
+    }
+    
+    if( std::filesystem::is_regular_file( input ) )
+        return mr.run( input );
+    
+    InputSource source( input );
+    return mr.run( source );
+}
+
+using LcpMapReduce = BasicMapReduce< std::string, int64_t, LineMapper, AdjacentLcpReducer, RangePartitioner< std::string > >;
+
+inline int find_prefix_single_pass( const std::filesystem::path& input, int mappers_count, int reducers_count, RecordFormat format,
+                                    bool processes, bool affinity )
+{
+    std::atomic< size_t > max_lcp{ 0 };
+    std::deque< PartitionEdges > edges;
+    std::mutex edges_mutex;
+    
+    LcpMapReduce mr( mappers_count, reducers_count );
+    mr.set_mapper( LineMapper() );
+    mr.set_combiner( PrefixCombiner( PrefixCombiner::DEFAULT_MEMORY_BUDGET, format ) );
+    mr.set_record_format( format );
+    mr.set_shuffle_memory( SHUFFLE_MEMORY );
+    mr.set_reducer( AdjacentLcpReducer( max_lcp, edges, edges_mutex ) );
+    
+    // редьюсер собирает результат в памяти этого процесса, поэтому в процессы уходит только map
+    if( processes )
+        mr.set_worker_processes( mappers_count );
+    if( affinity )
+        mr.set_cpu_affinity( true );
+    
+    if( !run_input( mr, input ) )
+        return 0;
+    
+    // партиции - непрерывные диапазоны, поэтому после сортировки по первой строке соседние партиции
+    // идут подряд, и последняя строка одной соседствует с первой строкой следующей
+    std::sort( edges.begin(), edges.end() );
+    
+    size_t lcp = max_lcp;
+    for( size_t i = 1; i < edges.size(); ++i )
+        lcp = std::max( lcp, common_prefix( edges[ i - 1 ].second, edges[ i ].first ) );
+    
+    return static_cast< int >( std::min< size_t >( lcp + 1, MAX_PREFIX_LENGTH ) );
+}
+
+struct CollidingLinesReducer
+{
+    explicit CollidingLinesReducer( int length )
+    : prefix_length( static_cast< size_t >( length ) )
+    {}
+    
+    // моё предложение:
+    //     * получает пару (строка, число) - строки идут по порядку,
+    //     * если префикс текущей строки совпадает с префиксом предыдущей, обе строки ещё не различимы
+    //       и уходят в следующий раунд,
+    //     * число > 1 значит одинаковые строки - их не различить никаким префиксом.
+    template< typename Out >
+    ReduceResult operator()( std::pair< std::string, int64_t >& data, Out& out )
+    {
+        if( data.second > 1 )
+            return ReduceResult::Abort;
+        
+        bool collides = has_previous && previous.compare( 0, prefix_length, data.first, 0, prefix_length ) == 0;
+        if( collides )
+        {
+            if( !previous_collides )
+                out.write( previous, 1 );
+            out.write( data.first, 1 );
+        }
+        
+        previous = data.first;
+        previous_collides = collides;
+        has_previous = true;
+        return ReduceResult::Continue;
+    }
+    
+private:
+    size_t prefix_length;
+    
+    std::string previous;
+    bool has_previous = false;
+    bool previous_collides = false;
+};
+
+// строки с общим первым байтом - в одной партиции, а диапазоны первых байтов выбираются по выборке в первом раунде
+using RoundsMapReduce = BasicMapReduce< std::string, int64_t, LineMapper, CollidingLinesReducer, FirstBytePartitioner >;
+
+// раунд k получает только строки, которые не различались префиксом длины k - 1
+inline int find_prefix_by_rounds( const std::filesystem::path& input, int mappers_count, int reducers_count, RecordFormat format,
+                                  bool processes, bool affinity )
+{
+    RoundsMapReduce mr( mappers_count, reducers_count );
+    
+    //     * сортирует файл от маппера в памяти (со сбросом на диск при нехватке памяти)
+    //     * и сразу выполняет предаггрегирование
+    mr.set_combiner( PrefixCombiner( PrefixCombiner::DEFAULT_MEMORY_BUDGET, format ) );
+    mr.set_record_format( format );
+    mr.set_shuffle_memory( SHUFFLE_MEMORY );
+    mr.set_mapper( LineMapper() );
+    
+    // весь выход редьюсера - в файле, так что и reduce можно отдать процессам
+    if( processes )
+        mr.set_worker_processes( mappers_count, true );
+    if( affinity )
+        mr.set_cpu_affinity( true );
+    
+    for( int prefix_length = 1; prefix_length < MAX_PREFIX_LENGTH; ++prefix_length )
+    {
+        mr.set_reducer( CollidingLinesReducer( prefix_length ) );
+        
+        // группы строк с общим префиксом при удлинении префикса только дробятся, поэтому выход
+        // раунда уже отсортирован и разложен по нужным партициям - следующему раунду хватает фазы reduce
+        bool ok = prefix_length == 1 ? run_input( mr, input ) : mr.run_reduce( mr.output_files() );
+        if( !ok )
+            return 0;
+        
+        auto outputs = mr.output_files();
+        bool resolved = std::all_of( outputs.begin(), outputs.end(),
+                                     []( const std::string& file ) { return std::filesystem::file_size( file ) == 0; } );
+        if( resolved )
+            return prefix_length;
+    }
+    
+    return 0;
+}
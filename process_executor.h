@@ -0,0 +1,385 @@
+#pragma once
+
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "async_io.h"
+
+// задача для рабочего процесса: что сделать, с каким номером и с какими файлами
+struct WorkerTask
+{
+    enum Kind : uint32_t
+    {
+        Map,
+        Reduce
+    };
+    
+    Kind kind;
+    int index;
+    std::vector< std::string > files;
+};
+
+// ответ рабочего процесса; error непустой - задача бросила исключение
+struct WorkerReply
+{
+    std::string error;
+    uint64_t result = 0;
+    std::array< uint64_t, 4 > counters{}; // записи и байты на входе и выходе - для метрик
+};
+
+/**
+ * Рабочие процессы на одной машине. Конструктор порождает processes процессов через fork(),
+ * каждый получает свой конец Unix domain socket и выполняет приходящие задачи функцией handler
+ * в своём адресном пространстве - с копией состояния, которое было у родителя в момент fork().
+ * Данные между процессами идут через файлы, по сокету - только описание задачи и короткий ответ.
+ *
+ * execute() можно звать из нескольких потоков: каждый вызов занимает свободный процесс и ждёт ответа.
+ * Если процесс упал (или его убило ограничение памяти), execute() бросает исключение с причиной,
+ * а родитель продолжает работать; упавший процесс больше задач не получает.
+ *
+ * memory_limit - ограничение адресного пространства каждого процесса (RLIMIT_AS), 0 - без ограничения.
+ * Деструктор закрывает сокеты - процессы видят конец потока и завершаются - и дожидается их.
+ *
+ * Экземпляров в процессе может быть несколько (задания на общем пуле). fork() копирует все дескрипторы,
+ * поэтому рабочий процесс сразу закрывает сокеты всех экземпляров, кроме своего: иначе он держал бы
+ * чужой сокет открытым, и его хозяин не увидел бы конца потока.
+ */
+class ProcessExecutor
+{
+public:
+    
+    using Handler = std::function< WorkerReply ( const WorkerTask& ) >;
+    
+    ProcessExecutor( int processes, const Handler& handler, size_t memory_limit = 0 )
+    {
+        for( int i = 0; i < processes; ++i )
+        {
+            // от socketpair() до закрытия конца потомка другие экземпляры не порождают процессов,
+            // иначе их потомки унаследовали бы и этот конец
+            std::unique_lock< std::mutex > lock( sockets_mutex() );
+            
+            int fds[ 2 ];
+            if( ::socketpair( AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds ) != 0 )
+            {
+                std::string error = std::strerror( errno );
+                lock.unlock();
+                shutdown();
+                throw std::runtime_error( "socketpair failed: " + error );
+            }
+            
+            pid_t pid = ::fork();
+            if( pid < 0 )
+            {
+                std::string error = std::strerror( errno );
+                ::close( fds[ 0 ] );
+                ::close( fds[ 1 ] );
+                lock.unlock();
+                shutdown();
+                throw std::runtime_error( "fork failed: " + error );
+            }
+            
+            if( pid == 0 )
+            {
+                // сокеты всех экземпляров, в том числе уже созданных процессов этого, достались и этому процессу
+                for( int fd : open_sockets() )
+                    ::close( fd );
+                ::close( fds[ 0 ] );
+                
+                serve( fds[ 1 ], handler, memory_limit );
+            }
+            
+            ::close( fds[ 1 ] );
+            open_sockets().push_back( fds[ 0 ] );
+            lock.unlock();
+            
+            workers.push_back( { pid, fds[ 0 ], true } );
+            idle.push_back( workers.size() - 1 );
+        }
+    }
+    
+    ProcessExecutor( const ProcessExecutor& ) = delete;
+    ProcessExecutor& operator=( const ProcessExecutor& ) = delete;
+    
+    ~ProcessExecutor()
+    {
+        shutdown();
+    }
+    
+    WorkerReply execute( const WorkerTask& task )
+    {
+        size_t w = acquire();
+        Worker& worker = workers[ w ];
+        
+        std::string request;
+        put( request, static_cast< uint64_t >( task.kind ) );
+        put( request, static_cast< uint64_t >( static_cast< int64_t >( task.index ) ) );
+        put( request, task.files.size() );
+        for( const auto& file : task.files )
+            put( request, file );
+        
+        std::string response;
+        if( !send_message( worker.fd, request ) || !receive_message( worker.fd, response ) )
+            throw_dead( w );
+        
+        release( w );
+        
+        WorkerReply reply;
+        const char* pos = response.data();
+        const char* end = pos + response.size();
+        if( !get( pos, end, reply.error ) || !get( pos, end, reply.result ) )
+            throw std::runtime_error( "malformed reply from worker process" );
+        for( auto& counter : reply.counters )
+            get( pos, end, counter );
+        
+        if( !reply.error.empty() )
+            throw std::runtime_error( "worker process: " + reply.error );
+        
+        return reply;
+    }
+    
+private:
+    struct Worker
+    {
+        pid_t pid;
+        int fd;
+        bool alive;
+    };
+    
+    // цикл рабочего процесса; из него не возвращаются - стек родителя, на котором мы стоим, трогать нельзя
+    [[noreturn]] static void serve( int fd, const Handler& handler, size_t memory_limit )
+    {
+        // потоков родителя в этом процессе нет - ввод-вывод не должен их ждать
+        async_io::after_fork();
+        
+        if( memory_limit )
+        {
+            rlimit limit{ memory_limit, memory_limit };
+            ::setrlimit( RLIMIT_AS, &limit );
+        }
+        
+        for( std::string request; receive_message( fd, request ); )
+        {
+            WorkerReply reply;
+            try
+            {
+                const char* pos = request.data();
+                const char* end = pos + request.size();
+                
+                uint64_t kind = 0;
+                uint64_t index = 0;
+                uint64_t files = 0;
+                get( pos, end, kind );
+                get( pos, end, index );
+                get( pos, end, files );
+                
+                WorkerTask task{ static_cast< WorkerTask::Kind >( kind ), static_cast< int >( static_cast< int64_t >( index ) ), {} };
+                for( uint64_t i = 0; i < files; ++i )
+                {
+                    task.files.emplace_back();
+                    if( !get( pos, end, task.files.back() ) )
+                        throw std::runtime_error( "malformed task" );
+                }
+                
+                reply = handler( task );
+            }
+            catch( const std::exception& e )
+            {
+                reply.error = e.what()[ 0 ] ? e.what() : "unknown error";
+            }
+            
+            std::string response;
+            put( response, reply.error );
+            put( response, reply.result );
+            for( uint64_t counter : reply.counters )
+                put( response, counter );
+            
+            if( !send_message( fd, response ) )
+                break;
+        }
+        
+        ::_exit( 0 );
+    }
+    
+    size_t acquire()
+    {
+        std::unique_lock< std::mutex > lock( mutex );
+        freed.wait( lock, [ this ] { return !idle.empty() || alive_count() == 0; } );
+        
+        if( idle.empty() )
+            throw std::runtime_error( "no worker processes left" );
+        
+        size_t w = idle.back();
+        idle.pop_back();
+        return w;
+    }
+    
+    void release( size_t w )
+    {
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            idle.push_back( w );
+        }
+        freed.notify_one();
+    }
+    
+    size_t alive_count() const
+    {
+        size_t alive = 0;
+        for( const Worker& worker : workers )
+            alive += worker.alive;
+        return alive;
+    }
+    
+    // процесс не ответил: забираем его и сообщаем, отчего он завершился
+    [[noreturn]] void throw_dead( size_t w )
+    {
+        Worker& worker = workers[ w ];
+        
+        int status = 0;
+        close_socket( worker.fd );
+        while( ::waitpid( worker.pid, &status, 0 ) < 0 && errno == EINTR )
+        {
+        }
+        
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            worker.alive = false;
+        }
+        freed.notify_all();
+        
+        std::string reason = WIFSIGNALED( status ) ? "killed by signal " + std::to_string( WTERMSIG( status ) )
+                                                   : "exited with code " + std::to_string( WEXITSTATUS( status ) );
+        throw std::runtime_error( "worker process " + std::to_string( worker.pid ) + " " + reason );
+    }
+    
+    void shutdown()
+    {
+        for( Worker& worker : workers )
+        {
+            if( !worker.alive )
+                continue;
+            
+            close_socket( worker.fd );
+            while( ::waitpid( worker.pid, nullptr, 0 ) < 0 && errno == EINTR )
+            {
+            }
+            worker.alive = false;
+        }
+    }
+    
+    // родительские концы сокетов всех экземпляров в процессе; меняются под sockets_mutex()
+    static std::mutex& sockets_mutex()
+    {
+        static std::mutex mutex;
+        return mutex;
+    }
+    
+    static std::vector< int >& open_sockets()
+    {
+        static std::vector< int > fds;
+        return fds;
+    }
+    
+    // номер закрытого дескриптора может достаться другому файлу - потомки не должны его закрывать
+    static void close_socket( int fd )
+    {
+        std::lock_guard< std::mutex > lock( sockets_mutex() );
+        auto& fds = open_sockets();
+        fds.erase( std::remove( fds.begin(), fds.end(), fd ), fds.end() );
+        ::close( fd );
+    }
+    
+    // сообщение: 8 байт длины и данные; процессы на одной машине, поэтому числа в родном порядке байт
+    static void put( std::string& out, uint64_t value )
+    {
+        out.append( reinterpret_cast< const char* >( &value ), sizeof( value ) );
+    }
+    
+    static void put( std::string& out, const std::string& value )
+    {
+        put( out, value.size() );
+        out.append( value );
+    }
+    
+    static bool get( const char*& pos, const char* end, uint64_t& value )
+    {
+        if( static_cast< size_t >( end - pos ) < sizeof( value ) )
+            return false;
+        std::memcpy( &value, pos, sizeof( value ) );
+        pos += sizeof( value );
+        return true;
+    }
+    
+    static bool get( const char*& pos, const char* end, std::string& value )
+    {
+        uint64_t size;
+        if( !get( pos, end, size ) || static_cast< uint64_t >( end - pos ) < size )
+            return false;
+        value.assign( pos, static_cast< size_t >( size ) );
+        pos += size;
+        return true;
+    }
+    
+    static bool send_message( int fd, const std::string& message )
+    {
+        std::string framed;
+        put( framed, message.size() );
+        framed.append( message );
+        
+        for( size_t done = 0; done < framed.size(); )
+        {
+            // MSG_NOSIGNAL: запись в сокет умершего процесса - ошибка, а не SIGPIPE
+            ssize_t sent = ::send( fd, framed.data() + done, framed.size() - done, MSG_NOSIGNAL );
+            if( sent < 0 && errno == EINTR )
+                continue;
+            if( sent <= 0 )
+                return false;
+            done += static_cast< size_t >( sent );
+        }
+        return true;
+    }
+    
+    static bool receive_all( int fd, char* data, size_t size )
+    {
+        while( size )
+        {
+            ssize_t got = ::recv( fd, data, size, 0 );
+            if( got < 0 && errno == EINTR )
+                continue;
+            if( got <= 0 )
+                return false;
+            data += got;
+            size -= static_cast< size_t >( got );
+        }
+        return true;
+    }
+    
+    static bool receive_message( int fd, std::string& message )
+    {
+        uint64_t size;
+        if( !receive_all( fd, reinterpret_cast< char* >( &size ), sizeof( size ) ) )
+            return false;
+        
+        message.resize( static_cast< size_t >( size ) );
+        return receive_all( fd, message.data(), message.size() );
+    }
+    
+    std::vector< Worker > workers;
+    std::vector< size_t > idle;
+    std::mutex mutex;
+    std::condition_variable freed;
+};
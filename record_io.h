@@ -0,0 +1,424 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "async_io.h"
+#include "block_codec.h"
+#include "output_sink.h"
+
+/**
+ * Бинарный формат промежуточных данных (выход маппера, ленты сортировки, вход редьюсера).
+ *
+ * Каждая запись - это ключ, за которым идёт значение. Как кодируется тип, решает RecordTraits:
+ *     строки           varint длина + байты
+ *     целые со знаком  varint (zigzag, чтобы отрицательные числа тоже были короткими)
+ *     целые без знака  varint
+ *     прочие POD       байты как есть, фиксированной длины
+ *
+ * Разделителей нет, поэтому ключ может содержать пробелы и переводы строк.
+ * Для просмотра файлов есть утилита mapreduce_dump.
+ *
+ * Непустой файл начинается с байта формата (RecordFormat): старшие 4 бита - FORMAT_MAGIC, младшие - флаги.
+ * Сжатые файлы дальше состоят из блоков OutputSink, а строковые ключи в файлах с front coding
+ * записаны как varint длина общего с предыдущим ключом префикса, varint длина хвоста и сам хвост.
+ * Читатель узнаёт формат из файла сам.
+ */
+namespace record_io
+{
+    inline uint64_t zigzag_encode( int64_t value )
+    {
+        return ( static_cast< uint64_t >( value ) << 1 ) ^ static_cast< uint64_t >( value >> 63 );
+    }
+    
+    inline int64_t zigzag_decode( uint64_t value )
+    {
+        return static_cast< int64_t >( value >> 1 ) ^ -static_cast< int64_t >( value & 1 );
+    }
+    
+    // записывает varint в out, возвращает количество байт (не больше 10)
+    inline size_t put_varint( char* out, uint64_t value )
+    {
+        size_t n = 0;
+        while( value >= 0x80 )
+        {
+            out[ n++ ] = static_cast< char >( ( value & 0x7f ) | 0x80 );
+            value >>= 7;
+        }
+        out[ n++ ] = static_cast< char >( value );
+        return n;
+    }
+    
+    inline void write_varint( OutputSink& sink, uint64_t value )
+    {
+        char buff[ 10 ];
+        sink.write( buff, put_varint( buff, value ) );
+    }
+    
+    static constexpr unsigned FORMAT_MAGIC = 0xa0;
+    static constexpr unsigned FORMAT_COMPRESSED = 1;
+    static constexpr unsigned FORMAT_FRONT_CODED = 2;
+}
+
+/**
+ * Формат файла записей, выбирается писателем:
+ *     compressed  - блочное сжатие: меньше ввода-вывода ценой процессора;
+ *     front_coded - строковые ключи без общего с предыдущим ключом префикса: для отсортированных серий
+ *                   это основной выигрыш, в неотсортированных данных почти бесполезно.
+ */
+struct RecordFormat
+{
+    bool compressed = false;
+    bool front_coded = false;
+};
+
+/**
+ * Буферизованное чтение байтов из файла промежуточных данных.
+ * Файл читается с упреждением (ReadAhead): следующий кусок уже в пути, пока разбирается текущий.
+ */
+class InputBuffer
+{
+public:
+    
+    explicit InputBuffer( const std::filesystem::path& path, size_t buffer_size = 1 << 16 )
+    : source( std::make_unique< ReadAhead >( path, buffer_size ) )
+    {}
+    
+    // первый байт файла, до всякой буферизации; -1 - файл пуст
+    int read_header()
+    {
+        char header;
+        if( source->read( &header, 1 ) != 1 )
+            return -1;
+        return static_cast< unsigned char >( header );
+    }
+    
+    // дальше файл состоит из сжатых блоков OutputSink
+    void set_compressed( bool enabled )
+    {
+        compressed = enabled;
+    }
+    
+    bool read_varint( uint64_t& value )
+    {
+        value = 0;
+        for( int shift = 0; shift < 64; shift += 7 )
+        {
+            if( pos == end && !fill() )
+                return false;
+            
+            uint8_t byte = static_cast< uint8_t >( data[ pos++ ] );
+            value |= static_cast< uint64_t >( byte & 0x7f ) << shift;
+            if( !( byte & 0x80 ) )
+                return true;
+        }
+        return false;
+    }
+    
+    bool read_bytes( char* out, size_t size )
+    {
+        while( size )
+        {
+            if( pos == end && !fill() )
+                return false;
+            
+            size_t chunk = std::min< size_t >( size, end - pos );
+            std::copy( data + pos, data + pos + chunk, out );
+            pos += chunk;
+            out += chunk;
+            size -= chunk;
+        }
+        return true;
+    }
+    
+private:
+    bool fill()
+    {
+        pos = 0;
+        end = 0;
+        
+        if( compressed )
+            return fill_block();
+        
+        // без сжатия разбираем прямо буфер упреждающего чтения, без копирования
+        return source->next_chunk( data, end );
+    }
+    
+    bool fill_block()
+    {
+        unsigned char header[ 8 ];
+        size_t header_size = source->read( reinterpret_cast< char* >( header ), sizeof( header ) );
+        if( header_size == 0 )
+            return false;
+        if( header_size != sizeof( header ) )
+            throw std::runtime_error( "truncated compressed block" );
+        
+        size_t size = get_uint32( header );
+        size_t packed_size = get_uint32( header + 4 );
+        
+        if( buff.size() < size )
+            buff.resize( size );
+        data = buff.data();
+        
+        if( !packed_size )
+        {
+            if( source->read( buff.data(), size ) != size )
+                throw std::runtime_error( "truncated compressed block" );
+        }
+        else
+        {
+            packed.resize( packed_size );
+            if( source->read( packed.data(), packed_size ) != packed_size ||
+                !block_codec::decompress( packed.data(), packed_size, buff.data(), size ) )
+                throw std::runtime_error( "corrupted compressed block" );
+        }
+        
+        end = size;
+        return size != 0;
+    }
+    
+    static size_t get_uint32( const unsigned char* in )
+    {
+        return static_cast< size_t >( in[ 0 ] ) | static_cast< size_t >( in[ 1 ] ) << 8 |
+               static_cast< size_t >( in[ 2 ] ) << 16 | static_cast< size_t >( in[ 3 ] ) << 24;
+    }
+    
+    std::unique_ptr< ReadAhead > source; // в куче: операция в полёте ссылается на его буферы, а InputBuffer перемещают
+    const char* data = nullptr;
+    size_t pos = 0;
+    size_t end = 0;
+    
+    bool compressed = false;
+    std::vector< char > buff;   // распакованный блок
+    std::vector< char > packed;
+};
+
+/**
+ * Сериализация типов ключей и значений, выбирается во время компиляции.
+ * Для своего типа достаточно специализировать RecordTraits с функциями write и read.
+ */
+template< typename T, typename Enable = void >
+struct RecordTraits
+{
+    static_assert( std::is_trivially_copyable_v< T >, "specialize RecordTraits for this type" );
+    
+    static void write( OutputSink& sink, const T& value )
+    {
+        sink.write( reinterpret_cast< const char* >( &value ), sizeof( T ) );
+    }
+    
+    static bool read( InputBuffer& in, T& value )
+    {
+        return in.read_bytes( reinterpret_cast< char* >( &value ), sizeof( T ) );
+    }
+};
+
+template< typename T >
+struct RecordTraits< T, std::enable_if_t< std::is_integral_v< T > > >
+{
+    static void write( OutputSink& sink, T value )
+    {
+        if constexpr ( std::is_signed_v< T > )
+            record_io::write_varint( sink, record_io::zigzag_encode( value ) );
+        else
+            record_io::write_varint( sink, value );
+    }
+    
+    static bool read( InputBuffer& in, T& value )
+    {
+        uint64_t encoded;
+        if( !in.read_varint( encoded ) )
+            return false;
+        
+        if constexpr ( std::is_signed_v< T > )
+            value = static_cast< T >( record_io::zigzag_decode( encoded ) );
+        else
+            value = static_cast< T >( encoded );
+        return true;
+    }
+};
+
+template<>
+struct RecordTraits< std::string >
+{
+    // принимает string_view, чтобы ключи можно было писать без создания std::string
+    static void write( OutputSink& sink, std::string_view value )
+    {
+        record_io::write_varint( sink, value.size() );
+        sink.write( value );
+    }
+    
+    static bool read( InputBuffer& in, std::string& value )
+    {
+        uint64_t size;
+        if( !in.read_varint( size ) )
+            return false;
+        
+        value.resize( size );
+        return in.read_bytes( value.data(), size );
+    }
+};
+
+template< typename Key, typename Value >
+class BasicRecordWriter
+{
+public:
+    
+    explicit BasicRecordWriter( const std::filesystem::path& path, RecordFormat format = RecordFormat(),
+                                size_t buffer_size = OutputSink::DEFAULT_BUFFER_SIZE )
+    : sink( path, buffer_size )
+    , format( format )
+    {
+        // front coding бывает только у строковых ключей
+        if constexpr ( !std::is_same_v< Key, std::string > )
+            this->format.front_coded = false;
+    }
+    
+    template< typename K >
+    void write( const K& key, const Value& value )
+    {
+        // байт формата пишется с первой записью, чтобы файл без записей оставался пустым
+        if( !started )
+            start();
+        ++records;
+        
+        if constexpr ( std::is_same_v< Key, std::string > )
+        {
+            if( format.front_coded )
+            {
+                std::string_view current( key );
+                size_t shared = static_cast< size_t >(
+                    std::mismatch( previous.begin(), previous.end(), current.begin(), current.end() ).first - previous.begin() );
+                
+                record_io::write_varint( sink, shared );
+                record_io::write_varint( sink, current.size() - shared );
+                sink.write( current.substr( shared ) );
+                previous.assign( current );
+                
+                RecordTraits< Value >::write( sink, value );
+                return;
+            }
+        }
+        
+        RecordTraits< Key >::write( sink, key );
+        RecordTraits< Value >::write( sink, value );
+    }
+    
+    void write( const std::pair< Key, Value >& record )
+    {
+        write( record.first, record.second );
+    }
+    
+    // явный сброс буфера; на каждую запись вызывать не нужно
+    void flush()
+    {
+        sink.flush();
+    }
+    
+    void close()
+    {
+        sink.close();
+    }
+    
+    size_t bytes_written() const
+    {
+        return sink.bytes_written();
+    }
+    
+    size_t records_written() const
+    {
+        return records;
+    }
+    
+private:
+    void start()
+    {
+        unsigned flags = record_io::FORMAT_MAGIC;
+        if( format.compressed )
+            flags |= record_io::FORMAT_COMPRESSED;
+        if( format.front_coded )
+            flags |= record_io::FORMAT_FRONT_CODED;
+        
+        char header = static_cast< char >( flags );
+        sink.write( &header, 1 );
+        if( format.compressed )
+            sink.set_compressed( true );
+        
+        started = true;
+    }
+    
+    OutputSink sink;
+    RecordFormat format;
+    bool started = false;
+    size_t records = 0;
+    std::string previous; // предыдущий ключ для front coding
+};
+
+template< typename Key, typename Value >
+class BasicRecordReader
+{
+public:
+    
+    explicit BasicRecordReader( const std::filesystem::path& path, size_t buffer_size = 1 << 16 )
+    : in( path, buffer_size )
+    {
+        int header = in.read_header();
+        if( header < 0 )
+            return; // пустой файл
+        
+        if( ( static_cast< unsigned >( header ) & 0xf0 ) != record_io::FORMAT_MAGIC )
+            throw std::runtime_error( "not a record file: " + path.string() );
+        
+        in.set_compressed( header & record_io::FORMAT_COMPRESSED );
+        front_coded = header & record_io::FORMAT_FRONT_CODED;
+    }
+    
+    // читает следующую запись, false - записи закончились
+    bool read( Key& key, Value& value )
+    {
+        return read_key( key ) && RecordTraits< Value >::read( in, value );
+    }
+    
+    bool read( std::pair< Key, Value >& record )
+    {
+        return read( record.first, record.second );
+    }
+    
+private:
+    bool read_key( Key& key )
+    {
+        if constexpr ( std::is_same_v< Key, std::string > )
+        {
+            if( front_coded )
+            {
+                uint64_t shared, size;
+                if( !in.read_varint( shared ) || !in.read_varint( size ) || shared > previous.size() )
+                    return false;
+                
+                previous.resize( shared + size );
+                if( !in.read_bytes( previous.data() + shared, size ) )
+                    return false;
+                
+                key.assign( previous );
+                return true;
+            }
+        }
+        
+        return RecordTraits< Key >::read( in, key );
+    }
+    
+    InputBuffer in;
+    bool front_coded = false;
+    std::string previous; // предыдущий ключ для front coding
+};
+
+using RecordWriter = BasicRecordWriter< std::string, int >;
+using RecordReader = BasicRecordReader< std::string, int >;
@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdlib.h>
+
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+
+/**
+ * Временный каталог с уникальным именем (mkdtemp), который удаляется вместе с содержимым в деструкторе -
+ * в том числе когда задание завершается исключением. Имя уникально и между процессами,
+ * поэтому задания, запущенные одновременно в одном каталоге, не затирают файлы друг друга.
+ *
+ *     ScratchDirectory job( "/mnt/tmpfs", "job-" );
+ *     RecordWriter writer( job.file( "part0.bin" ) );
+ */
+class ScratchDirectory
+{
+public:
+    
+    ScratchDirectory() = default;
+    
+    explicit ScratchDirectory( const std::filesystem::path& parent, const std::string& prefix = "mapreduce-" )
+    {
+        std::filesystem::create_directories( parent );
+        
+        std::string name = ( parent / ( prefix + "XXXXXX" ) ).string();
+        if( !::mkdtemp( name.data() ) )
+            throw std::runtime_error( "can't create scratch directory in " + parent.string() );
+        
+        dir = name;
+    }
+    
+    ScratchDirectory( ScratchDirectory&& other ) noexcept
+    : dir( std::exchange( other.dir, std::filesystem::path() ) )
+    {}
+    
+    ScratchDirectory& operator=( ScratchDirectory&& other ) noexcept
+    {
+        if( this != &other )
+        {
+            remove();
+            dir = std::exchange( other.dir, std::filesystem::path() );
+        }
+        return *this;
+    }
+    
+    ScratchDirectory( const ScratchDirectory& ) = delete;
+    ScratchDirectory& operator=( const ScratchDirectory& ) = delete;
+    
+    ~ScratchDirectory()
+    {
+        remove();
+    }
+    
+    bool empty() const
+    {
+        return dir.empty();
+    }
+    
+    const std::filesystem::path& path() const
+    {
+        return dir;
+    }
+    
+    std::string file( const std::string& name ) const
+    {
+        return ( dir / name ).string();
+    }
+    
+private:
+    void remove() noexcept
+    {
+        if( dir.empty() )
+            return;
+        
+        std::error_code error; // из деструктора не бросаем: каталог мог удалить кто-то ещё
+        std::filesystem::remove_all( dir, error );
+        dir.clear();
+    }
+    
+    std::filesystem::path dir;
+};
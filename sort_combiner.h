@@ -0,0 +1,139 @@
+#pragma once
+
+#include <algorithm>
+#include <filesystem>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "kway_merge.h"
+#include "arena.h"
+#include "record_io.h"
+
+/**
+ * Встроенный комбайнер: сортирует и предаггрегирует выход маппера в памяти.
+ *
+ * Записи складываются в хеш-таблицу (одинаковые ключи сразу суммируются),
+ * затем сортируются только различные ключи. Если таблица перерастает memory_budget байт,
+ * она сбрасывается на диск отсортированной серией, а в конце серии сливаются.
+ *
+ * Ключ должен поддерживать std::hash и operator<.
+ * Используется вместо MergeSort:
+ *     mr.set_combiner( SortCombiner( 64 << 20 ) );
+ */
+template< typename Key, typename Value >
+class BasicSortCombiner
+{
+public:
+    
+    static constexpr size_t DEFAULT_MEMORY_BUDGET = 64 << 20;
+    
+    // выход комбайнера отсортирован, поэтому front coding из format ему всегда на пользу
+    explicit BasicSortCombiner( size_t budget = DEFAULT_MEMORY_BUDGET, RecordFormat format = RecordFormat() )
+    : memory_budget( budget )
+    , format( format )
+    {}
+    
+    void operator()( const std::string& filename, int thread_num ) const
+    {
+        // ключи и узлы таблицы - в арене: на запись нет ни одного выделения из кучи,
+        // а после сброса серии следующая пишется в те же блоки
+        Arena arena;
+        std::optional< Table > table;
+        table.emplace( 0, std::hash< View >(), std::equal_to< View >(), ArenaAllocator< std::pair< const View, Value > >( &arena ) );
+        
+        std::vector< std::string > runs;
+        
+        {
+            BasicRecordReader< Key, Value > input( filename );
+            
+            Key key; // буфер ключа переиспользуется
+            Value value;
+            while( input.read( key, value ) )
+            {
+                View view = ArenaKey< Key >::view( key );
+                auto it = table->find( view );
+                if( it != table->end() )
+                {
+                    it->second += value;
+                    continue;
+                }
+                
+                table->emplace( ArenaKey< Key >::store( arena, view ), value );
+                
+                if( arena.bytes_used() > memory_budget )
+                {
+                    runs.push_back( run_file( filename, thread_num, runs.size() ) );
+                    
+                    spill( *table, runs.back() );
+                    
+                    // таблицу - до сброса арены, в которой лежат её узлы
+                    table.emplace( 0, std::hash< View >(), std::equal_to< View >(), ArenaAllocator< std::pair< const View, Value > >( &arena ) );
+                    arena.reset();
+                }
+            }
+        }
+        
+        if( runs.empty() )
+        {
+            spill( *table, filename );
+            return;
+        }
+        
+        if( !table->empty() )
+        {
+            runs.push_back( run_file( filename, thread_num, runs.size() ) );
+            
+            spill( *table, runs.back() );
+        }
+        
+        merge_runs( runs, filename );
+        
+        for( const auto& run : runs )
+            std::filesystem::remove( run );
+    }
+    
+private:
+    using View = typename ArenaKey< Key >::View;
+    using Table = std::unordered_map< View, Value, std::hash< View >, std::equal_to< View >,
+                                      ArenaAllocator< std::pair< const View, Value > > >;
+    
+    // серии лежат рядом с сортируемым файлом - в каталоге его задания
+    static std::string run_file( const std::string& filename, int thread_num, size_t run )
+    {
+        std::stringstream run_name;
+        run_name << "E" << thread_num << "_" << run << ".bin";
+        return ( std::filesystem::path( filename ).parent_path() / run_name.str() ).string();
+    }
+    
+    void spill( const Table& table, const std::string& filename ) const
+    {
+        std::vector< const std::pair< const View, Value >* > sorted;
+        sorted.reserve( table.size() );
+        for( const auto& entry : table )
+            sorted.push_back( &entry );
+        
+        std::sort( sorted.begin(), sorted.end(), []( auto* a, auto* b ) { return a->first < b->first; } );
+        
+        BasicRecordWriter< Key, Value > output( filename, format );
+        for( const auto* entry : sorted )
+            output.write( entry->first, entry->second );
+    }
+    
+    // сливает отсортированные серии, суммируя одинаковые ключи
+    void merge_runs( const std::vector< std::string >& runs, const std::string& filename ) const
+    {
+        BasicKWayMerge< Key, Value > merge( runs );
+        BasicRecordWriter< Key, Value > output( filename, format );
+        
+        for( std::pair< Key, Value > record; merge.next( record ); )
+            output.write( record );
+    }
+    
+    size_t memory_budget;
+    RecordFormat format;
+};
+
+using SortCombiner = BasicSortCombiner< std::string, int >;
@@ -0,0 +1,194 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "cancellation.h"
+
+/**
+ * Спекулятивное выполнение отстающих задач одной фазы - как в Hadoop.
+ *
+ * Задача выполняется попытками. Попытка 0 запускается обычным порядком; когда задача заметно отстаёт
+ * от уже завершившихся соседей, stragglers() выдаёт её для попытки 1 - её ставят на простаивающий поток.
+ * Попытки пишут результат во временные файлы (file()); первая закончившая вызывает commit(),
+ * фиксирует результат переименованием файлов на место, а проигравшей взводится её флаг отмены.
+ *
+ * Задача считается отстающей, если идёт дольше SLOWDOWN медиан уже завершившихся задач фазы
+ * (и не меньше MIN_RUNTIME), а по её прогрессу до конца осталось больше медианы: иначе копия не успеет обогнать.
+ * Если объём работы задачи неизвестен, судим только по времени.
+ */
+class SpeculativeTasks
+{
+public:
+    
+    static constexpr int ATTEMPTS = 2;
+    static constexpr double SLOWDOWN = 1.5;
+    static constexpr std::chrono::milliseconds MIN_RUNTIME{ 50 };
+    
+    using Clock = std::chrono::steady_clock;
+    
+    // одна попытка: её флаг отмены и сделанная работа (в тех же единицах, что размер задачи)
+    struct Attempt
+    {
+        int number = 0;
+        CancellationToken cancel;
+        std::atomic< uint64_t > progress{ 0 };
+        
+        bool cancelled() const
+        {
+            return cancel.cancelled();
+        }
+        
+        // временный файл попытки вместо file
+        std::string file( const std::string& file ) const
+        {
+            return file + ".attempt" + std::to_string( number );
+        }
+    };
+    
+    // sizes[ i ] - объём работы задачи i (например, байт входа), 0 - неизвестен
+    explicit SpeculativeTasks( const std::vector< uint64_t >& sizes = {} )
+    {
+        for( uint64_t size : sizes )
+            add( size );
+    }
+    
+    SpeculativeTasks( const SpeculativeTasks& ) = delete;
+    SpeculativeTasks& operator=( const SpeculativeTasks& ) = delete;
+    
+    // следующая задача - когда их число заранее неизвестно (вход читается по мере работы)
+    void add( uint64_t size )
+    {
+        std::lock_guard< std::mutex > lock( mutex );
+        Task& t = tasks.emplace_back();
+        t.size = size;
+        for( int a = 0; a < ATTEMPTS; ++a )
+            t.attempts[ a ].number = a;
+    }
+    
+    Attempt& attempt( size_t task, int attempt )
+    {
+        return task_at( task ).attempts[ attempt ];
+    }
+    
+    // попытка начала работу; время задачи отсчитывается от начала попытки 0
+    void started( size_t task, int attempt )
+    {
+        if( attempt )
+            return;
+        
+        std::lock_guard< std::mutex > lock( mutex );
+        tasks[ task ].started = Clock::now();
+        tasks[ task ].running = true;
+    }
+    
+    // true - попытка первой завершила задачу и должна зафиксировать результат; остальные попытки отменяются
+    bool commit( size_t task, int attempt )
+    {
+        Task& t = task_at( task );
+        
+        int none = -1;
+        if( !t.winner.compare_exchange_strong( none, attempt ) )
+            return false;
+        
+        for( int a = 0; a < ATTEMPTS; ++a )
+        {
+            if( a != attempt )
+                t.attempts[ a ].cancel.cancel();
+        }
+        
+        std::lock_guard< std::mutex > lock( mutex );
+        t.running = false;
+        completed.push_back( Clock::now() - t.started );
+        if( attempt )
+            ++wins;
+        return true;
+    }
+    
+    // отстающие задачи, которым пора запустить копию, - не больше limit; каждая выдаётся один раз
+    std::vector< size_t > stragglers( size_t limit )
+    {
+        std::vector< size_t > result;
+        
+        std::lock_guard< std::mutex > lock( mutex );
+        if( completed.empty() )
+            return result;
+        
+        auto median = completed.begin() + completed.size() / 2;
+        std::nth_element( completed.begin(), median, completed.end() );
+        double median_s = std::chrono::duration< double >( *median ).count();
+        
+        auto now = Clock::now();
+        for( size_t i = 0; i < tasks.size() && result.size() < limit; ++i )
+        {
+            Task& t = tasks[ i ];
+            if( !t.running || t.speculated )
+                continue;
+            
+            double elapsed_s = std::chrono::duration< double >( now - t.started ).count();
+            if( now - t.started < MIN_RUNTIME || elapsed_s < SLOWDOWN * median_s )
+                continue;
+            
+            uint64_t done = t.attempts[ 0 ].progress.load( std::memory_order_relaxed );
+            if( t.size && done )
+            {
+                double fraction = std::min( 1.0, static_cast< double >( done ) / static_cast< double >( t.size ) );
+                if( elapsed_s * ( 1.0 - fraction ) / fraction < median_s )
+                    continue;
+            }
+            
+            t.speculated = true;
+            ++launched;
+            result.push_back( i );
+        }
+        
+        return result;
+    }
+    
+    // сколько копий запущено и сколько из них обогнали исходную попытку
+    size_t launched_count() const
+    {
+        std::lock_guard< std::mutex > lock( mutex );
+        return launched;
+    }
+    
+    size_t wins_count() const
+    {
+        std::lock_guard< std::mutex > lock( mutex );
+        return wins;
+    }
+    
+private:
+    struct Task
+    {
+        uint64_t size = 0;
+        std::array< Attempt, ATTEMPTS > attempts;
+        std::atomic< int > winner{ -1 };
+        
+        // под mutex
+        Clock::time_point started;
+        bool running = false;
+        bool speculated = false;
+    };
+    
+    // задачи добавляются, пока другие выполняются: deque не переносит элементы, но искать в ней - под mutex
+    Task& task_at( size_t task )
+    {
+        std::lock_guard< std::mutex > lock( mutex );
+        return tasks[ task ];
+    }
+    
+    std::deque< Task > tasks;
+    
+    mutable std::mutex mutex;
+    std::vector< Clock::duration > completed;
+    size_t launched = 0;
+    size_t wins = 0;
+};
@@ -0,0 +1,1242 @@
+#define BOOST_TEST_MODULE test_mapreduce
+
+#include "arena.h"
+#include "async_io.h"
+#include "block_codec.h"
+#include "cpu_topology.h"
+#include "input_source.h"
+#include "kway_merge.h"
+#include "line_splitter.h"
+#include "mapreduce.h"
+#include "prefix_length.h"
+#include "record_io.h"
+#include "sort_combiner.h"
+#include "thread_pool.h"
+
+#include <boost/test/unit_test.hpp>
+
+#include <atomic>
+#include <csignal>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <unistd.h>
+
+BOOST_AUTO_TEST_SUITE(test_line_splitter)
+
+BOOST_AUTO_TEST_CASE(test_find_newline) {
+	for (size_t len = 0; len < 100; ++len) {
+		std::string s(len, 'a');
+		BOOST_CHECK(find_newline(s.data(), s.data() + len) == s.data() + len);
+		for (size_t pos = 0; pos < len; ++pos) {
+			s[pos] = '\n';
+			BOOST_CHECK(find_newline(s.data(), s.data() + len) == s.data() + pos);
+			s[pos] = 'a';
+		}
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_for_each_line) {
+	std::string text = "one\n\nthree\nfour";
+	std::vector<std::string> expected = {"one", "", "three", "four"};
+
+	std::vector<std::string> lines;
+	for_each_line(std::string_view(text), [&](std::string_view line) { lines.emplace_back(line); });
+	BOOST_CHECK(lines == expected);
+
+	lines.clear();
+	for_each_line(std::string_view(text + "\n"), [&](std::string_view line) { lines.emplace_back(line); });
+	BOOST_CHECK(lines == expected);
+
+	for (size_t window = 1; window < 8; ++window) {
+		std::istringstream is(text + "\n");
+		lines.clear();
+		for_each_line(is, text.size() + 1, [&](std::string_view line) { lines.emplace_back(line); }, window);
+		BOOST_CHECK(lines == expected);
+	}
+}
+
+BOOST_AUTO_TEST_CASE(test_find_newline_in_stream) {
+	std::istringstream is("abc\ndef\n");
+	BOOST_CHECK_EQUAL(find_newline(is, 0, 8, 2), 3u);
+	BOOST_CHECK_EQUAL(find_newline(is, 4, 8, 2), 7u);
+	BOOST_CHECK_EQUAL(find_newline(is, 8, 8, 2), 8u);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(test_record_io)
+
+BOOST_AUTO_TEST_CASE(test_round_trip) {
+	std::vector<std::pair<std::string, int>> records = {
+		{"key with spaces", 1}, {"", 0}, {"line\nbreak", -5}, {std::string(300, 'x'), 1 << 30}};
+
+	auto path = std::filesystem::temp_directory_path() / "test_record_io.bin";
+	{
+		RecordWriter writer(path);
+		for (const auto& record : records)
+			writer.write(record);
+	}
+
+	RecordReader reader(path, 7);
+	std::pair<std::string, int> record;
+	for (const auto& expected : records) {
+		BOOST_REQUIRE(reader.read(record));
+		BOOST_CHECK(record == expected);
+	}
+	BOOST_CHECK(!reader.read(record));
+
+	std::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_CASE(test_block_codec) {
+	std::string input;
+	for (int i = 0; i < 20000; ++i)
+		input += "prefix" + std::to_string(i % 1000) + (i % 3 ? "aaaaaaaaaaaaaaaaaaaaaaaa" : "") + "\n";
+
+	std::vector<char> packed(block_codec::compress_bound(input.size()));
+	size_t packed_size = block_codec::compress(input.data(), input.size(), packed.data());
+	BOOST_CHECK_LT(packed_size, input.size() / 4);
+
+	std::string output(input.size(), '\0');
+	BOOST_REQUIRE(block_codec::decompress(packed.data(), packed_size, output.data(), output.size()));
+	BOOST_CHECK(output == input);
+
+	// повреждённый блок не читается за границы и распознаётся
+	BOOST_CHECK(!block_codec::decompress(packed.data(), packed_size / 2, output.data(), output.size()));
+}
+
+BOOST_AUTO_TEST_CASE(test_compressed_front_coded_round_trip) {
+	std::vector<std::pair<std::string, int>> records;
+	for (int i = 0; i < 100000; ++i)
+		records.emplace_back("key" + std::to_string(1000000 + i), i);
+
+	auto path = std::filesystem::temp_directory_path() / "test_record_io.bin";
+	for (RecordFormat format : {RecordFormat{true, false}, RecordFormat{false, true}, RecordFormat{true, true}}) {
+		{
+			RecordWriter writer(path, format, 4096); // маленький буфер - много блоков
+			for (const auto& record : records)
+				writer.write(record);
+		}
+
+		RecordReader reader(path);
+		std::pair<std::string, int> record;
+		for (const auto& expected : records) {
+			BOOST_REQUIRE(reader.read(record));
+			BOOST_REQUIRE(record == expected);
+		}
+		BOOST_CHECK(!reader.read(record));
+	}
+
+	{
+		RecordWriter writer(path, RecordFormat{true, true});
+	}
+	BOOST_CHECK_EQUAL(std::filesystem::file_size(path), 0u); // без записей файл пуст
+
+	std::filesystem::remove(path);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(test_async_io)
+
+BOOST_AUTO_TEST_CASE(test_backends_and_read_ahead) {
+	auto path = std::filesystem::temp_directory_path() / "test_async_io.bin";
+	std::string data;
+	for (int i = 0; i < 100000; ++i)
+		data += std::to_string(i) + ",";
+
+	for (auto backend : {async_io::Backend::Sync, async_io::Backend::Threads, async_io::Backend::IoUring}) {
+		int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+		BOOST_REQUIRE(fd >= 0);
+		{
+			AsyncFile file(fd, backend);
+			file.start_write(data.data(), data.size(), 0);
+			BOOST_CHECK_EQUAL(file.wait(), static_cast<ssize_t>(data.size()));
+
+			std::string back(data.size(), '\0');
+			file.start_read(back.data(), back.size(), 0);
+			BOOST_CHECK_EQUAL(file.wait(), static_cast<ssize_t>(data.size()));
+			BOOST_CHECK(back == data);
+		}
+		::close(fd);
+	}
+
+	// мелкие куски: упреждающее чтение много раз переключает буферы
+	ReadAhead reader(path, 1000);
+	std::string back;
+	const char* chunk;
+	size_t size;
+	char first[10];
+	BOOST_CHECK_EQUAL(reader.read(first, sizeof(first)), sizeof(first));
+	back.append(first, sizeof(first));
+	while (reader.next_chunk(chunk, size))
+		back.append(chunk, size);
+	BOOST_CHECK(back == data);
+
+	// файлы одного потока делят кольцо: операций в полёте больше, чем вмещает очередь завершений,
+	// и ждут их в обратном порядке
+	{
+		int fd = ::open(path.c_str(), O_RDONLY);
+		BOOST_REQUIRE(fd >= 0);
+		static constexpr size_t FILES = 300;
+		std::vector<std::unique_ptr<AsyncFile>> files;
+		std::vector<std::string> parts(FILES, std::string(100, '\0'));
+		for (size_t i = 0; i < FILES; ++i) {
+			files.push_back(std::make_unique<AsyncFile>(fd, async_io::Backend::IoUring));
+			files[i]->start_read(parts[i].data(), parts[i].size(), i * 100);
+		}
+		for (size_t i = FILES; i-- > 0;) {
+			BOOST_CHECK_EQUAL(files[i]->wait(), 100);
+			BOOST_CHECK(parts[i] == data.substr(i * 100, 100));
+		}
+		::close(fd);
+	}
+
+	std::filesystem::remove(path);
+
+	// пропавший файл - ошибка, а не пустой вход
+	BOOST_CHECK_THROW(ReadAhead(path, 1000), std::runtime_error);
+	BOOST_CHECK_THROW(RecordReader(path.string()), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(test_arena)
+
+BOOST_AUTO_TEST_CASE(test_store_and_reset) {
+	Arena arena(64);
+	std::string_view a = arena.store("hello");
+	std::string_view b = arena.store(std::string(100, 'x')); // больше блока - отдельный блок
+	BOOST_CHECK_EQUAL(a, "hello");
+	BOOST_CHECK_EQUAL(b, std::string(100, 'x'));
+
+	size_t capacity = arena.capacity();
+	arena.reset();
+	BOOST_CHECK_EQUAL(arena.bytes_used(), 0u);
+	BOOST_CHECK_EQUAL(arena.store("again"), "again");
+	BOOST_CHECK_EQUAL(arena.capacity(), capacity); // после reset блоки переиспользуются
+
+	using Allocator = ArenaAllocator<std::pair<const std::string_view, int>>;
+	std::unordered_map<std::string_view, int, std::hash<std::string_view>, std::equal_to<std::string_view>, Allocator>
+		table(0, std::hash<std::string_view>(), std::equal_to<std::string_view>(), Allocator(&arena));
+	for (int i = 0; i < 1000; ++i)
+		table[arena.store(std::to_string(i % 100))] += 1;
+	BOOST_CHECK_EQUAL(table.size(), 100u);
+	BOOST_CHECK_EQUAL(table["42"], 10);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(test_sort_combiner)
+
+BOOST_AUTO_TEST_CASE(test_combine_with_spills) {
+	std::vector<std::pair<std::string, int>> input = {{"b", 1}, {"a", 1}, {"c", 2}, {"a", 3}, {"b", 1}};
+	std::vector<std::pair<std::string, int>> expected = {{"a", 4}, {"b", 2}, {"c", 2}};
+
+	for (size_t budget : {size_t(1), SortCombiner::DEFAULT_MEMORY_BUDGET}) {
+		std::string path = "test_sort_combiner.bin";
+		{
+			RecordWriter writer(path);
+			for (const auto& record : input)
+				writer.write(record);
+		}
+
+		SortCombiner combiner(budget);
+		combiner(path, 0);
+
+		RecordReader reader(path);
+		std::vector<std::pair<std::string, int>> output;
+		for (std::pair<std::string, int> record; reader.read(record);)
+			output.push_back(record);
+		BOOST_CHECK(output == expected);
+
+		std::filesystem::remove(path);
+	}
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(test_kway_merge)
+
+BOOST_AUTO_TEST_CASE(test_merge_files_and_memory_runs) {
+	// серия r получает ключи, у которых i % (r + 2) == 0, - один ключ попадает в несколько серий,
+	// а в серии повторяется подряд; одна серия-файл и одна серия в памяти пусты
+	static constexpr int FILE_RUNS = 5;
+	static constexpr int MEMORY_RUNS = 3;
+	std::map<std::string, int> expected;
+	auto run_records = [&](int r) {
+		std::map<std::string, int> records;
+		if (r == 0 || r == FILE_RUNS)
+			return records;
+		for (int i = 0; i < 500; ++i) {
+			if (i % (r + 2) == 0) {
+				std::string key = "key" + std::to_string(i);
+				records[key] = r + 1;
+				expected[key] += 2 * (r + 1);
+			}
+		}
+		return records;
+	};
+
+	std::vector<std::string> files;
+	for (int r = 0; r < FILE_RUNS; ++r) {
+		files.push_back((std::filesystem::temp_directory_path() / ("test_kway_merge" + std::to_string(r) + ".bin")).string());
+		RecordWriter writer(files.back(), RecordFormat{r % 2 == 1, r % 2 == 1});
+		for (const auto& record : run_records(r)) {
+			writer.write(record.first, record.second);
+			writer.write(record.first, record.second);
+		}
+	}
+
+	auto arena = std::make_shared<Arena>();
+	std::vector<KWayMerge::Run> memory(MEMORY_RUNS);
+	std::vector<const KWayMerge::Run*> memory_runs;
+	for (int m = 0; m < MEMORY_RUNS; ++m) {
+		memory[m].arena = arena;
+		for (const auto& record : run_records(FILE_RUNS + m)) {
+			memory[m].records.emplace_back(arena->store(record.first), record.second);
+			memory[m].records.emplace_back(arena->store(record.first), record.second);
+		}
+		memory_runs.push_back(&memory[m]);
+	}
+
+	KWayMerge merge(files, memory_runs, 64); // маленький буфер - чтение файлов много раз переключает буферы
+	std::vector<std::pair<std::string, int>> output;
+	for (std::pair<std::string, int> record; merge.next(record);)
+		output.push_back(record);
+
+	BOOST_CHECK(std::is_sorted(output.begin(), output.end()));
+	BOOST_CHECK(std::adjacent_find(output.begin(), output.end(),
+	                               [](const auto& a, const auto& b) { return a.first == b.first; }) == output.end());
+	BOOST_CHECK((std::map<std::string, int>(output.begin(), output.end()) == expected));
+
+	for (const auto& file : files)
+		std::filesystem::remove(file);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(test_mapreduce)
+
+BOOST_AUTO_TEST_CASE(test_split_range_large_file) {
+	// 20 GiB на 8 блоков: длина блока больше INT_MAX, файл для этого не нужен
+	const std::uintmax_t whole_size = std::uintmax_t(20) << 30;
+	const std::uintmax_t interval = whole_size / 8;
+
+	auto blocks = MapReduce::split_range(whole_size, 8, [](size_t pos) { return pos; });
+
+	BOOST_REQUIRE_EQUAL(blocks.size(), 8u);
+	BOOST_CHECK_EQUAL(blocks.front().from, 0u);
+	BOOST_CHECK_EQUAL(blocks.back().to, whole_size);
+	for (size_t i = 0; i < blocks.size(); ++i) {
+		BOOST_CHECK_EQUAL(blocks[i].to - blocks[i].from, i + 1 < blocks.size() ? interval : interval - 7);
+		if (i)
+			BOOST_CHECK_EQUAL(blocks[i].from, blocks[i - 1].to + 1);
+	}
+
+	// размер не делится на число блоков: граница округляется вверх и не выходит за конец
+	blocks = MapReduce::split_range(whole_size + 1, 3, [](size_t pos) { return pos; });
+	BOOST_REQUIRE_EQUAL(blocks.size(), 3u);
+	BOOST_CHECK_EQUAL(blocks[0].to, (whole_size + 3) / 3);
+	BOOST_CHECK_EQUAL(blocks[2].to, whole_size + 1);
+}
+
+BOOST_AUTO_TEST_CASE(test_same_key_lands_on_one_reducer) {
+	std::string input = "test_mapreduce_input.txt";
+	{
+		std::ofstream os(input);
+		for (int i = 0; i < 300; ++i)
+			os << "key" << i % 7 << "\n";
+	}
+
+	std::mutex mutex;
+	std::map<std::string, int> counts;
+
+	MapReduce mr(3, 2);
+	mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) { emit(line, 1); });
+	mr.set_combiner(SortCombiner());
+	mr.set_reducer([&](std::pair<std::string, int>& data) {
+		std::lock_guard<std::mutex> lock(mutex);
+		BOOST_CHECK(counts.emplace(data.first, data.second).second);
+		return true;
+	});
+	mr.run(input, "test_mapreduce_output.txt", 1);
+
+	BOOST_CHECK_EQUAL(counts.size(), 7u);
+	for (const auto& entry : counts)
+		BOOST_CHECK(entry.second == 43 || entry.second == 42);
+
+	std::filesystem::remove(input);
+	std::filesystem::remove("test_mapreduce_output.txt");
+}
+
+BOOST_AUTO_TEST_CASE(test_integer_keys_and_many_emits) {
+	std::string input = "test_mapreduce_input.txt";
+	{
+		std::ofstream os(input);
+		os << "1 2 3\n\n3 3\n2\n";
+	}
+
+	struct WordMapper {
+		void operator()(std::string_view line, Emitter<uint32_t, uint64_t>& emit) const {
+			for (char c : line)
+				if (c != ' ')
+					emit(static_cast<uint32_t>(c - '0'), uint64_t(1) << 40);
+		}
+	};
+
+	std::mutex mutex;
+	std::map<uint32_t, uint64_t> counts;
+	auto reducer = [&](std::pair<uint32_t, uint64_t>& data) {
+		std::lock_guard<std::mutex> lock(mutex);
+		counts[data.first] += data.second;
+		return true;
+	};
+
+	BasicMapReduce<uint32_t, uint64_t, WordMapper, decltype(reducer)> mr(2, 3);
+	mr.set_mapper(WordMapper());
+	mr.set_reducer(reducer);
+	mr.run(input, "test_mapreduce_output.txt", 1);
+
+	std::map<uint32_t, uint64_t> expected = {{1, 1ull << 40}, {2, 2ull << 40}, {3, 3ull << 40}};
+	BOOST_CHECK(counts == expected);
+
+	std::filesystem::remove(input);
+	std::filesystem::remove("test_mapreduce_output.txt");
+}
+
+BOOST_AUTO_TEST_CASE(test_in_memory_shuffle) {
+	std::string input = "test_mapreduce_input.txt";
+	{
+		std::ofstream os(input);
+		for (int i = 0; i < 3000; ++i)
+			os << "key" << i % 700 << "\n";
+	}
+
+	for (size_t budget : {size_t(64) << 20, size_t(1)}) {
+		std::mutex mutex;
+		std::map<std::string, int> counts;
+		auto reducer = [&](std::pair<std::string, int>& data) {
+			std::lock_guard<std::mutex> lock(mutex);
+			counts[data.first] += data.second;
+			return true;
+		};
+
+		BasicMapReduce<std::string, int, MapperFunction<std::string, int>, decltype(reducer)> mr(2, 3);
+		mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) { emit(line, 1); });
+		mr.set_reducer(reducer);
+		mr.set_shuffle_memory(budget); // бюджет в 1 байт - сброс на диск на каждом ключе
+		BOOST_CHECK(mr.run(input));
+
+		BOOST_CHECK_EQUAL(counts.size(), 700u);
+		BOOST_CHECK_EQUAL(counts["key0"], 5);
+		BOOST_CHECK_EQUAL(counts["key699"], 4);
+	}
+
+	std::filesystem::remove(input);
+}
+
+BOOST_AUTO_TEST_CASE(test_job_metrics) {
+	if (!job_metrics::ENABLED)
+		return;
+
+	std::string input = "test_mapreduce_input.txt";
+	{
+		std::ofstream os(input);
+		for (int i = 0; i < 3000; ++i)
+			os << (i % 3 ? "heavy" : "key" + std::to_string(i)) << "\n";
+	}
+
+	auto reducer = [](std::pair<std::string, int>&) { return true; };
+	BasicMapReduce<std::string, int, MapperFunction<std::string, int>, decltype(reducer)> mr(2, 4);
+	mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) { emit(line, 1); });
+	mr.set_reducer(reducer);
+	mr.set_trace_file("test_mapreduce_trace.json");
+
+	RunResult result = mr.run(input);
+	BOOST_REQUIRE(result);
+
+	const JobMetrics& metrics = result.metrics;
+	const PhaseMetrics& map = metrics.phase(job_metrics::Phase::Map);
+	BOOST_CHECK(map.tasks >= 2);
+	BOOST_CHECK_EQUAL(map.records_in, 3000u);
+	BOOST_CHECK_EQUAL(map.records_out, 3000u);
+	BOOST_CHECK_EQUAL(map.bytes_in, std::filesystem::file_size(input));
+	BOOST_CHECK(map.max_task_us >= map.median_task_us);
+
+	// ключи комбайнер уже свернул: 1000 разных key* и один heavy
+	BOOST_CHECK_EQUAL(metrics.phase(job_metrics::Phase::Reduce).tasks, 4u);
+	BOOST_CHECK_EQUAL(metrics.phase(job_metrics::Phase::Reduce).records_in, 1001u);
+	BOOST_REQUIRE_EQUAL(metrics.partition_records.size(), 4u);
+	BOOST_CHECK(metrics.largest_partition >= 0);
+	BOOST_CHECK(metrics.partition_skew() >= 1.0);
+
+	std::ifstream trace("test_mapreduce_trace.json");
+	std::string json((std::istreambuf_iterator<char>(trace)), std::istreambuf_iterator<char>());
+	BOOST_CHECK(json.find("\"traceEvents\"") != std::string::npos);
+	BOOST_CHECK(json.find("\"name\":\"reduce 3\"") != std::string::npos);
+
+	std::filesystem::remove("test_mapreduce_trace.json");
+	std::filesystem::remove(input);
+}
+
+BOOST_AUTO_TEST_CASE(test_worker_processes) {
+	std::string input = "test_mapreduce_input.txt";
+	{
+		std::ofstream os(input);
+		for (int i = 0; i < 3000; ++i)
+			os << "key" << i % 700 << "\n";
+	}
+
+	// map в процессах, reduce здесь: редьюсер пишет в память этого процесса
+	{
+		std::mutex mutex;
+		std::map<std::string, int> counts;
+		auto reducer = [&](std::pair<std::string, int>& data) {
+			std::lock_guard<std::mutex> lock(mutex);
+			counts[data.first] += data.second;
+			return true;
+		};
+
+		BasicMapReduce<std::string, int, MapperFunction<std::string, int>, decltype(reducer)> mr(2, 3);
+		mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) { emit(line, 1); });
+		mr.set_reducer(reducer);
+		mr.set_worker_processes(2);
+		BOOST_CHECK(mr.run(input));
+
+		BOOST_CHECK_EQUAL(counts.size(), 700u);
+		BOOST_CHECK_EQUAL(counts["key0"], 5);
+	}
+
+	// reduce тоже в процессах: обратно приходят выходные файлы
+	{
+		auto reducer = [](std::pair<std::string, int>& data, RecordWriter& out) {
+			out.write(data.first, data.second);
+			return data.first == "key13" ? ReduceResult::Abort : ReduceResult::Continue;
+		};
+
+		BasicMapReduce<std::string, int, MapperFunction<std::string, int>, decltype(reducer)> mr(2, 3);
+		mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) {
+			if (line != "key13")
+				emit(line, 1);
+		});
+		mr.set_reducer(reducer);
+		mr.set_worker_processes(2, true);
+		BOOST_REQUIRE(mr.run(input));
+
+		std::map<std::string, int> counts;
+		for (const auto& file : mr.output_files()) {
+			RecordReader reader(file);
+			for (std::pair<std::string, int> record; reader.read(record);)
+				counts[record.first] += record.second;
+		}
+		BOOST_CHECK_EQUAL(counts.size(), 699u);
+		BOOST_CHECK_EQUAL(counts["key699"], 4);
+
+		// Abort из рабочего процесса отменяет задание
+		mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) { emit(line, 1); });
+		BOOST_CHECK(!mr.run(input));
+	}
+
+	// упавший маппер роняет только свой процесс
+	{
+		auto reducer = [](std::pair<std::string, int>&) { return true; };
+		BasicMapReduce<std::string, int, MapperFunction<std::string, int>, decltype(reducer)> mr(2, 2);
+		mr.set_mapper([](std::string_view line, Emitter<std::string, int>&) {
+			if (line == "key42")
+				::kill(::getpid(), SIGKILL);
+		});
+		mr.set_reducer(reducer);
+		mr.set_worker_processes(2);
+		BOOST_CHECK_THROW(mr.run(input), std::runtime_error);
+
+		// и исключение маппера доходит до вызывающего с текстом
+		mr.set_mapper([](std::string_view, Emitter<std::string, int>&) { throw std::runtime_error("bad line"); });
+		try {
+			mr.run(input);
+			BOOST_ERROR("exception expected");
+		} catch (const std::runtime_error& e) {
+			BOOST_CHECK(std::string(e.what()).find("bad line") != std::string::npos);
+		}
+	}
+
+	std::filesystem::remove(input);
+}
+
+BOOST_AUTO_TEST_CASE(test_executors_do_not_share_sockets) {
+	// процесс второго экземпляра порождён, пока сокет первого открыт, - он не должен его держать
+	auto handler = [](const WorkerTask& task) {
+		WorkerReply reply;
+		reply.result = static_cast<uint64_t>(task.index);
+		return reply;
+	};
+	auto first = std::make_unique<ProcessExecutor>(1, handler);
+	auto second = std::make_unique<ProcessExecutor>(1, handler);
+	BOOST_CHECK_EQUAL(first->execute({WorkerTask::Map, 7, {}}).result, 7u);
+
+	// деструктор первого ждёт свой процесс, а тот завершится, только увидев конец потока
+	std::atomic<bool> destroyed{false};
+	std::thread destroyer([&] {
+		first.reset();
+		destroyed = true;
+	});
+	for (int i = 0; i < 5000 && !destroyed; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	BOOST_CHECK(destroyed.load());
+
+	BOOST_CHECK_EQUAL(second->execute({WorkerTask::Reduce, 3, {}}).result, 3u);
+	second.reset(); // без исправления только это и отпустило бы первый экземпляр
+	destroyer.join();
+}
+
+BOOST_AUTO_TEST_CASE(test_concurrent_jobs_on_shared_pool) {
+	auto root = std::filesystem::temp_directory_path() / "test_mapreduce_scratch";
+	std::filesystem::remove_all(root);
+
+	std::string input = "test_mapreduce_input.txt";
+	{
+		std::ofstream os(input);
+		for (int i = 0; i < 3000; ++i)
+			os << "key" << i % 700 << "\n";
+	}
+
+	static constexpr int JOBS = 4;
+	ThreadPool pool(2);
+	std::vector<std::map<std::string, int>> counts(JOBS);
+	std::vector<std::mutex> mutexes(JOBS);
+	{
+		std::vector<std::unique_ptr<MapReduce>> jobs;
+		for (int j = 0; j < JOBS; ++j) {
+			jobs.push_back(std::make_unique<MapReduce>(2, j + 1, pool));
+			jobs[j]->set_scratch_directory(root);
+			jobs[j]->set_mapper([j](std::string_view line, Emitter<std::string, int>& emit) { emit(line, j + 1); });
+			jobs[j]->set_reducer([&counts, &mutexes, j](std::pair<std::string, int>& data) {
+				std::lock_guard<std::mutex> lock(mutexes[j]);
+				counts[j][data.first] += data.second;
+				return true;
+			});
+		}
+
+		std::vector<std::thread> threads;
+		std::atomic<int> succeeded{0};
+		for (int j = 0; j < JOBS; ++j)
+			threads.emplace_back([&, j] { succeeded += static_cast<bool>(jobs[j]->run(input)); });
+		for (auto& thread : threads)
+			thread.join();
+
+		BOOST_CHECK_EQUAL(succeeded.load(), JOBS);
+		for (int j = 0; j < JOBS; ++j) {
+			BOOST_CHECK_EQUAL(counts[j].size(), 700u);
+			BOOST_CHECK_EQUAL(counts[j]["key0"], 5 * (j + 1));
+		}
+
+		// у каждого экземпляра свой каталог, а каталоги заданий уже удалены
+		int instances = 0;
+		for (const auto& dir : std::filesystem::directory_iterator(root)) {
+			++instances;
+			for (const auto& entry : std::filesystem::directory_iterator(dir.path()))
+				BOOST_CHECK(!entry.is_directory());
+		}
+		BOOST_CHECK_EQUAL(instances, JOBS);
+	}
+
+	BOOST_CHECK(std::filesystem::is_empty(root));
+	std::filesystem::remove_all(root);
+	std::filesystem::remove(input);
+}
+
+BOOST_AUTO_TEST_CASE(test_speculative_execution) {
+	// поток, первым дошедший до проверки, тормозит на каждой записи - как задача на медленном узле;
+	// копия той же задачи в другом потоке идёт с обычной скоростью
+	std::mutex slow_mutex;
+	std::thread::id slow_thread;
+	auto is_slow = [&] {
+		std::lock_guard<std::mutex> lock(slow_mutex);
+		if (slow_thread == std::thread::id())
+			slow_thread = std::this_thread::get_id();
+		return slow_thread == std::this_thread::get_id();
+	};
+	// копия отстающей задачи запущена и обогнала её; попытки писали во временные файлы в каталоге экземпляра,
+	// и ни одного не осталось: победившая переименовала свои на место, проигравшая удалила
+	auto root = std::filesystem::temp_directory_path() / "test_mapreduce_scratch";
+	std::filesystem::remove_all(root);
+	auto check_speculated = [&root](const RunResult& result) {
+		BOOST_CHECK(result);
+		if (job_metrics::ENABLED) {
+			BOOST_CHECK_GE(result.metrics.speculative_attempts, 1u);
+			BOOST_CHECK_GE(result.metrics.speculative_wins, 1u);
+		}
+		for (const auto& entry : std::filesystem::recursive_directory_iterator(root))
+			BOOST_CHECK(entry.path().string().find(".attempt") == std::string::npos);
+	};
+
+	std::string input = "test_mapreduce_input.txt";
+
+	// отстающая map-задача: первая четверть файла - её блок
+	{
+		{
+			std::ofstream os(input);
+			for (int i = 0; i < 4000; ++i)
+				os << (i < 1000 ? "s" : "k") << i % 10 << "\n";
+		}
+
+		std::mutex mutex;
+		std::map<std::string, int> counts;
+		auto reducer = [&](std::pair<std::string, int>& data) {
+			std::lock_guard<std::mutex> lock(mutex);
+			counts[data.first] += data.second;
+			return true;
+		};
+
+		BasicMapReduce<std::string, int, MapperFunction<std::string, int>, decltype(reducer)> mr(4, 2);
+		mr.set_mapper([&](std::string_view line, Emitter<std::string, int>& emit) {
+			if (line[0] == 's' && is_slow())
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+			emit(line, 1);
+		});
+		mr.set_reducer(reducer);
+		mr.set_scratch_directory(root);
+		mr.set_speculation(true);
+		check_speculated(mr.run(input));
+
+		// выход проигравшей попытки до редьюсеров не дошёл
+		BOOST_CHECK_EQUAL(counts.size(), 20u);
+		BOOST_CHECK_EQUAL(counts["s0"], 100);
+		BOOST_CHECK_EQUAL(counts["k9"], 300);
+	}
+
+	// отстающая reduce-задача: редьюсер без побочных эффектов, результат - выходные файлы
+	{
+		{
+			std::ofstream os(input);
+			for (int i = 0; i < 4000; ++i)
+				os << "key" << i << "\n";
+		}
+		slow_thread = std::thread::id();
+
+		auto reducer = [&](std::pair<std::string, int>& data, RecordWriter& out) {
+			if (is_slow())
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+			out.write(data.first, data.second);
+			return true;
+		};
+
+		BasicMapReduce<std::string, int, MapperFunction<std::string, int>, decltype(reducer)> mr(2, 2);
+		mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) { emit(line, 1); });
+		mr.set_reducer(reducer);
+		mr.set_scratch_directory(root);
+		mr.set_speculation(true, true);
+		check_speculated(mr.run(input));
+
+		// выходы редьюсеров - файлы победивших попыток, каждая запись по одному разу
+		std::map<std::string, int> counts;
+		for (const auto& file : mr.output_files()) {
+			RecordReader reader(file);
+			for (std::pair<std::string, int> record; reader.read(record);)
+				counts[record.first] += record.second;
+		}
+		BOOST_CHECK_EQUAL(counts.size(), 4000u);
+		BOOST_CHECK(std::all_of(counts.begin(), counts.end(), [](const auto& count) { return count.second == 1; }));
+	}
+
+	std::filesystem::remove_all(root);
+	std::filesystem::remove(input);
+}
+
+BOOST_AUTO_TEST_CASE(test_reject_and_abort) {
+	std::string input = "test_mapreduce_input.txt";
+	{
+		std::ofstream os(input);
+		for (int i = 0; i < 1000; ++i)
+			os << i % 500 << "\n";
+	}
+
+	for (ReduceResult verdict : {ReduceResult::Reject, ReduceResult::Abort}) {
+		std::atomic<int> calls{0};
+		auto reducer = [&](std::pair<std::string, int>&) {
+			++calls;
+			return verdict;
+		};
+
+		BasicMapReduce<std::string, int, MapperFunction<std::string, int>, decltype(reducer)> mr(2, 1);
+		mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) { emit(line, 1); });
+		mr.set_reducer(reducer);
+
+		BOOST_CHECK(!mr.run(input, "test_mapreduce_output.txt", 1));
+		BOOST_CHECK(!std::filesystem::exists("test_mapreduce_output.txt"));
+		BOOST_CHECK_EQUAL(calls.load(), verdict == ReduceResult::Reject ? 500 : 1);
+	}
+
+	std::filesystem::remove(input);
+}
+
+BOOST_AUTO_TEST_CASE(test_chained_rounds) {
+	std::string input = "test_mapreduce_input.txt";
+	{
+		std::ofstream os(input);
+		os << "aa\nab\nb\naa\nc\nab\n";
+	}
+
+	// пропускает в следующий раунд только повторяющиеся ключи
+	struct RepeatedKeysReducer {
+		std::map<std::string, int>* seen;
+		std::mutex* mutex;
+
+		ReduceResult operator()(std::pair<std::string, int>& data, RecordWriter& out) {
+			std::lock_guard<std::mutex> lock(*mutex);
+			(*seen)[data.first] += data.second;
+			if (data.second > 1)
+				out.write(data.first, data.second);
+			return ReduceResult::Continue;
+		}
+	};
+
+	std::mutex mutex;
+	std::map<std::string, int> seen;
+
+	BasicMapReduce<std::string, int, MapperFunction<std::string, int>, RepeatedKeysReducer> mr(2, 2);
+	mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) { emit(line, 1); });
+	mr.set_reducer(RepeatedKeysReducer{&seen, &mutex});
+
+	BOOST_REQUIRE(mr.run(input));
+	BOOST_CHECK(seen == (std::map<std::string, int>{{"aa", 2}, {"ab", 2}, {"b", 1}, {"c", 1}}));
+
+	seen.clear();
+	BOOST_REQUIRE(mr.run_reduce(mr.output_files()));
+	BOOST_CHECK(seen == (std::map<std::string, int>{{"aa", 2}, {"ab", 2}}));
+
+	seen.clear();
+	BOOST_REQUIRE(mr.run_records(mr.output_files()));
+	BOOST_CHECK(seen == (std::map<std::string, int>{{"aa", 1}, {"ab", 1}}));
+
+	std::filesystem::remove(input);
+}
+
+BOOST_AUTO_TEST_CASE(test_range_partitioner) {
+	// "m" - тяжёлый ключ: половина выборки
+	std::vector<std::string> sample = {"a", "b", "c", "d", "m", "m", "m", "m", "m", "m", "x", "y"};
+	RangePartitioner<std::string> partitioner;
+	partitioner.fit(sample, 4);
+
+	BOOST_CHECK_EQUAL(partitioner.split_points().size(), 3u);
+	int heavy = partitioner(std::string_view("m"), 4);
+	BOOST_CHECK_NE(partitioner(std::string_view("d"), 4), heavy);
+	BOOST_CHECK_NE(partitioner(std::string_view("x"), 4), heavy);
+	BOOST_CHECK_LE(partitioner(std::string_view("a"), 4), partitioner(std::string_view("z"), 4));
+
+	// выходы редьюсеров по порядку дают полностью отсортированную последовательность
+	std::string input = "test_mapreduce_input.txt";
+	{
+		std::ofstream os(input);
+		for (int i = 0; i < 5000; ++i)
+			os << "k" << (i * 7919) % 5000 << "\n";
+	}
+
+	auto reducer = [](std::pair<std::string, int>& data, RecordWriter& out) {
+		out.write(data.first, data.second);
+		return true;
+	};
+	using Reducer = decltype(reducer);
+
+	BasicMapReduce<std::string, int, MapperFunction<std::string, int, RangePartitioner<std::string>>, Reducer,
+	               RangePartitioner<std::string>>
+		mr(2, 4);
+	mr.set_mapper([](std::string_view line, Emitter<std::string, int, RangePartitioner<std::string>>& emit) { emit(line, 1); });
+	mr.set_reducer(reducer);
+	BOOST_REQUIRE(mr.run(input));
+
+	std::vector<std::string> keys;
+	size_t largest = 0;
+	for (const auto& file : mr.output_files()) {
+		RecordReader reader(file);
+		size_t before = keys.size();
+		for (std::pair<std::string, int> record; reader.read(record);)
+			keys.push_back(record.first);
+		largest = std::max(largest, keys.size() - before);
+	}
+	BOOST_CHECK_EQUAL(keys.size(), 5000u);
+	BOOST_CHECK(std::is_sorted(keys.begin(), keys.end()));
+	BOOST_CHECK_LT(largest, 2500u); // ни один редьюсер не получил половину ключей
+
+	std::filesystem::remove(input);
+}
+
+BOOST_AUTO_TEST_CASE(test_first_byte_partitioner) {
+	// только строчные буквы: первые байты занимают узкий диапазон, а партиций всё равно несколько
+	std::vector<std::string> sample;
+	for (char c = 'a'; c <= 'z'; ++c)
+		sample.push_back(std::string(1, c) + "x");
+	FirstBytePartitioner partitioner;
+	partitioner.fit(sample, 4);
+
+	std::vector<int> sizes(4);
+	for (char c = 'a'; c <= 'z'; ++c)
+		++sizes[partitioner(std::string(1, c), 4)];
+	for (int size : sizes)
+		BOOST_CHECK(size >= 6 && size <= 8);
+	BOOST_CHECK_EQUAL(partitioner(std::string_view("ka"), 4), partitioner(std::string_view("kz"), 4));
+	BOOST_CHECK_LE(partitioner(std::string_view("b"), 4), partitioner(std::string_view("c"), 4));
+
+	// поток: границы выбираются по его началу, и строки доходят до нескольких редьюсеров
+	std::FILE* stream = std::tmpfile();
+	for (int i = 0; i < 3000; ++i)
+		std::fprintf(stream, "%c%d\n", 'a' + i % 26, i);
+	std::rewind(stream);
+
+	auto reducer = [](std::pair<std::string, int>& data, RecordWriter& out) {
+		out.write(data.first, data.second);
+		return true;
+	};
+	BasicMapReduce<std::string, int, MapperFunction<std::string, int, FirstBytePartitioner>, decltype(reducer),
+	               FirstBytePartitioner>
+		mr(2, 4);
+	mr.set_mapper([](std::string_view line, Emitter<std::string, int, FirstBytePartitioner>& emit) { emit(line, 1); });
+	mr.set_reducer(reducer);
+	InputSource source(stream, 4096);
+	BOOST_REQUIRE(mr.run(source));
+	std::fclose(stream);
+
+	std::vector<std::string> keys;
+	int used = 0;
+	for (const auto& file : mr.output_files()) {
+		RecordReader reader(file);
+		size_t before = keys.size();
+		for (std::pair<std::string, int> record; reader.read(record);)
+			keys.push_back(record.first);
+		used += keys.size() > before;
+	}
+	BOOST_CHECK_EQUAL(keys.size(), 3000u);
+	BOOST_CHECK(std::is_sorted(keys.begin(), keys.end()));
+	BOOST_CHECK_GT(used, 1);
+
+	// раунды дают тот же ответ, что и один проход
+	std::string input = "test_mapreduce_input.txt";
+	{
+		std::ofstream os(input);
+		for (int i = 0; i < 3000; ++i)
+			os << static_cast<char>('a' + i % 26) << i << "\n";
+	}
+	for (int reducers : {1, 4})
+		BOOST_CHECK_EQUAL(find_prefix_by_rounds(input, 2, reducers, RecordFormat(), false, false),
+		                  find_prefix_single_pass(input, 2, reducers, RecordFormat(), false, false));
+	std::filesystem::remove(input);
+}
+
+BOOST_AUTO_TEST_CASE(test_prefix_length_single_pass) {
+	std::string input = "test_mapreduce_input.txt";
+	auto write_lines = [&](const std::vector<std::string>& lines) {
+		std::ofstream os(input);
+		for (const auto& line : lines)
+			os << line << "\n";
+	};
+
+	// по строке на партицию: максимальный LCP ("ban") есть только у соседей через границу партиций
+	write_lines({"bandana", "apple", "banana", "apricot"});
+	for (int reducers : {1, 4, 8})
+		BOOST_CHECK_EQUAL(find_prefix_single_pass(input, 2, reducers, RecordFormat(), false, false), 4);
+
+	// одинаковые строки не различить никаким префиксом - ответа нет
+	write_lines({"bandana", "apple", "banana", "apricot", "banana"});
+	for (int reducers : {1, 4})
+		BOOST_CHECK_EQUAL(find_prefix_single_pass(input, 2, reducers, RecordFormat(), false, false), 0);
+
+	std::filesystem::remove(input);
+}
+
+BOOST_AUTO_TEST_CASE(test_pipeline_with_intermediate_merges) {
+	// входов больше, чем MERGE_FAN_IN, - серии партиций сливаются ещё во время map
+	std::vector<std::string> inputs;
+	for (int i = 0; i < 40; ++i) {
+		inputs.push_back("test_mapreduce_input" + std::to_string(i) + ".bin");
+		RecordWriter writer(inputs.back());
+		for (int k = 0; k < 50; ++k)
+			writer.write("key" + std::to_string((i + k) % 60), 1);
+	}
+
+	for (bool pipeline : {true, false}) {
+		std::mutex mutex;
+		std::map<std::string, int> counts;
+		auto reducer = [&](std::pair<std::string, int>& data) {
+			std::lock_guard<std::mutex> lock(mutex);
+			counts[data.first] += data.second;
+			return true;
+		};
+
+		BasicMapReduce<std::string, int, MapperFunction<std::string, int>, decltype(reducer)> mr(2, 2);
+		mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) { emit(line, 1); });
+		mr.set_reducer(reducer);
+		mr.set_pipeline(pipeline);
+		BOOST_CHECK(mr.run_records(inputs));
+
+		BOOST_CHECK_EQUAL(counts.size(), 60u);
+		int total = 0;
+		for (const auto& count : counts)
+			total += count.second;
+		BOOST_CHECK_EQUAL(total, 40 * 50);
+	}
+
+	for (const auto& input : inputs)
+		std::filesystem::remove(input);
+}
+
+BOOST_AUTO_TEST_CASE(test_input_source) {
+	// каталог: мелкие файлы собираются в один кусок, большой режется по границам строк
+	std::filesystem::path dir = "test_mapreduce_input_dir";
+	std::filesystem::remove_all(dir);
+	std::filesystem::create_directories(dir / "sub");
+	for (int i = 0; i < 5; ++i) {
+		std::ofstream os(dir / ("small" + std::to_string(i) + ".txt"));
+		os << "key" << i << "\nkey" << i + 1 << "\n";
+	}
+	{
+		std::ofstream os(dir / "sub" / "large.log");
+		for (int i = 0; i < 1000; ++i)
+			os << "key" << i % 100 << "\n";
+	}
+
+	auto read_all = [](InputSource& source, size_t& chunks) {
+		std::map<std::string, int> counts;
+		InputChunk chunk;
+		chunks = 0;
+		while (source.next(chunk)) {
+			++chunks;
+			chunk.for_each_line([&](std::string_view line) { ++counts[std::string(line)]; });
+		}
+		return counts;
+	};
+
+	size_t chunks = 0;
+	{
+		InputSource source(dir, 1000);
+		BOOST_CHECK(source.seekable());
+		auto counts = read_all(source, chunks);
+		BOOST_CHECK_EQUAL(counts.size(), 100u);
+		BOOST_CHECK_EQUAL(counts["key0"], 11);
+		BOOST_CHECK_EQUAL(counts["key5"], 11);
+		BOOST_CHECK_EQUAL(counts["key6"], 10);
+		// 5 * 10 + 5890 байт - примерно по 1000 в куске
+		BOOST_CHECK(chunks >= 6 && chunks <= 7);
+	}
+
+	// маска и кусок, переданный рабочему процессу строками
+	{
+		InputSource source((dir / "small*.txt").string(), 1000);
+		InputChunk chunk;
+		BOOST_CHECK(source.next(chunk));
+		BOOST_CHECK_EQUAL(chunk.pieces.size(), 5u);
+		BOOST_CHECK(!source.next(chunk));
+
+		InputSource again((dir / "small*.txt").string(), 1000);
+		again.next(chunk);
+		InputChunk decoded = InputChunk::decode(chunk.encode());
+		BOOST_CHECK_EQUAL(decoded.size(), chunk.size());
+		BOOST_CHECK_EQUAL(decoded.pieces[4].file, chunk.pieces[4].file);
+	}
+	BOOST_CHECK_THROW(InputSource((dir / "none*.txt").string()), std::runtime_error);
+
+	// поток: читается только вперёд, последняя строка без перевода строки не теряется
+	auto make_stream = [] {
+		std::FILE* stream = std::tmpfile();
+		for (int i = 0; i < 3000; ++i)
+			std::fprintf(stream, "key%d%s", i % 700, i + 1 < 3000 ? "\n" : "");
+		std::rewind(stream);
+		return stream;
+	};
+	{
+		std::FILE* stream = make_stream();
+		InputSource source(stream, 4096);
+		BOOST_CHECK(!source.seekable());
+		auto counts = read_all(source, chunks);
+		std::fclose(stream);
+		BOOST_CHECK_EQUAL(counts.size(), 700u);
+		BOOST_CHECK_EQUAL(counts["key0"], 5);
+		BOOST_CHECK_EQUAL(counts["key199"], 5); // последняя строка входа
+		BOOST_CHECK(chunks >= 5);
+	}
+
+	// задачи выдаются по мере чтения; с потоком работают и рабочие процессы
+	for (bool processes : {false, true}) {
+		std::mutex mutex;
+		std::map<std::string, int> counts;
+		auto reducer = [&](std::pair<std::string, int>& data) {
+			std::lock_guard<std::mutex> lock(mutex);
+			counts[data.first] += data.second;
+			return true;
+		};
+
+		BasicMapReduce<std::string, int, MapperFunction<std::string, int>, decltype(reducer)> mr(2, 2);
+		mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) { emit(line, 1); });
+		mr.set_reducer(reducer);
+		if (processes)
+			mr.set_worker_processes(2);
+
+		InputSource files(dir, 1000);
+		BOOST_CHECK(mr.run(files));
+		BOOST_CHECK_EQUAL(counts.size(), 100u);
+		BOOST_CHECK_EQUAL(counts["key0"], 11);
+
+		counts.clear();
+		std::FILE* stream = make_stream();
+		InputSource source(stream, 4096);
+		BOOST_CHECK(mr.run(source));
+		std::fclose(stream);
+		BOOST_CHECK_EQUAL(counts.size(), 700u);
+		BOOST_CHECK_EQUAL(counts["key0"], 5);
+	}
+
+	// файл маски пропал, пока задачи по предыдущим файлам уже в пуле: задание отменяется, исключение доходит до вызывающего
+	{
+		for (int i = 0; i < 40; ++i) {
+			std::ofstream os(dir / ("part" + std::to_string(i) + ".txt"));
+			for (int k = 0; k < 100; ++k)
+				os << "key" << k << "\n";
+		}
+
+		auto reducer = [](std::pair<std::string, int>&) { return true; };
+		BasicMapReduce<std::string, int, MapperFunction<std::string, int>, decltype(reducer)> mr(2, 2);
+		mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) {
+			std::this_thread::sleep_for(std::chrono::microseconds(100)); // задачи ещё в пуле, когда источник бросает
+			emit(line, 1);
+		});
+		mr.set_reducer(reducer);
+
+		InputSource source((dir / "part*.txt").string(), 600);
+		std::filesystem::remove(dir / "part39.txt");
+		BOOST_CHECK_THROW(mr.run(source), std::runtime_error);
+
+		// экземпляр после этого годен для следующего запуска
+		mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) { emit(line, 1); });
+		InputSource again((dir / "part*.txt").string(), 600);
+		BOOST_CHECK(mr.run(again));
+	}
+
+	std::filesystem::remove_all(dir);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(test_thread_pool)
+
+BOOST_AUTO_TEST_CASE(test_cpu_topology) {
+	BOOST_CHECK((CpuTopology::parse_cpu_list("0-3,8,10-11\n") == std::vector<int>{0, 1, 2, 3, 8, 10, 11}));
+	BOOST_CHECK(CpuTopology::parse_cpu_list("").empty());
+
+	// два узла; у ядер 0-3 по два аппаратных потока: 0 с 1, 2 с 3; ядро 5 процессу запрещено
+	auto sysfs = std::filesystem::temp_directory_path() / "test_mapreduce_sysfs";
+	std::filesystem::remove_all(sysfs);
+	auto write = [&](const std::filesystem::path& file, const std::string& text) {
+		std::filesystem::create_directories((sysfs / file).parent_path());
+		std::ofstream(sysfs / file) << text << "\n";
+	};
+	write("node/node0/cpulist", "0-3");
+	write("node/node1/cpulist", "4-7");
+	write("node/has_cpu", "0-7");
+	for (int cpu = 0; cpu < 4; ++cpu)
+		write("cpu/cpu" + std::to_string(cpu) + "/topology/thread_siblings_list", cpu < 2 ? "0-1" : "2-3");
+
+	CpuTopology topology = CpuTopology::detect(sysfs, {0, 1, 2, 3, 4, 6, 7});
+	BOOST_REQUIRE_EQUAL(topology.nodes.size(), 2u);
+	BOOST_CHECK((topology.nodes[0] == std::vector<int>{0, 2, 1, 3})); // сначала по потоку на физическое ядро
+	BOOST_CHECK((topology.nodes[1] == std::vector<int>{4, 6, 7}));
+	BOOST_CHECK_EQUAL(topology.cpus_count(), 7u);
+
+	// соседние потоки - на одном узле
+	BOOST_CHECK((topology.place(0, 4) == std::pair<int, int>(0, 0)));
+	BOOST_CHECK((topology.place(1, 4) == std::pair<int, int>(0, 2)));
+	BOOST_CHECK((topology.place(2, 4) == std::pair<int, int>(1, 4)));
+	BOOST_CHECK((topology.place(3, 4) == std::pair<int, int>(1, 6)));
+
+	// без NUMA в sysfs - один узел из разрешённых ядер
+	std::filesystem::remove_all(sysfs);
+	topology = CpuTopology::detect(sysfs, {1, 3});
+	BOOST_REQUIRE_EQUAL(topology.nodes.size(), 1u);
+	BOOST_CHECK((topology.nodes[0] == std::vector<int>{1, 3}));
+
+	// закреплённый поток пула работает на одном ядре
+	ThreadPool pool(2);
+	pool.pin(CpuTopology::detect());
+	std::atomic<int> cpus{0};
+	{
+		TaskGroup group(pool);
+		group.run([&] {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			::sched_getaffinity(0, sizeof(set), &set);
+			cpus = CPU_COUNT(&set);
+		}, 0);
+		group.wait();
+	}
+	BOOST_CHECK_EQUAL(cpus.load(), 1);
+	pool.unpin();
+
+	// общий пул закрепляют и открепляют, пока другое задание ставит задачи на узлы
+	{
+		std::atomic<int> ran{0};
+		TaskGroup group(pool);
+		std::thread submitter([&] {
+			for (int i = 0; i < 2000; ++i)
+				group.run([&] { ++ran; }, i % static_cast<int>(pool.nodes() + 1));
+		});
+		for (int i = 0; i < 50; ++i) {
+			pool.pin(CpuTopology::detect());
+			pool.unpin();
+		}
+		submitter.join();
+		group.wait();
+		BOOST_CHECK_EQUAL(ran.load(), 2000);
+	}
+
+	std::string input = "test_mapreduce_input.txt";
+	{
+		std::ofstream os(input);
+		for (int i = 0; i < 3000; ++i)
+			os << "key" << i % 700 << "\n";
+	}
+
+	std::mutex mutex;
+	std::map<std::string, int> counts;
+	MapReduce mr(2, 2);
+	mr.set_cpu_affinity(true);
+	mr.set_mapper([](std::string_view line, Emitter<std::string, int>& emit) { emit(line, 1); });
+	mr.set_reducer([&](std::pair<std::string, int>& data) {
+		std::lock_guard<std::mutex> lock(mutex);
+		counts[data.first] += data.second;
+		return true;
+	});
+	BOOST_CHECK(mr.run(input));
+	BOOST_CHECK_EQUAL(counts.size(), 700u);
+	BOOST_CHECK_EQUAL(counts["key0"], 5);
+
+	std::filesystem::remove(input);
+}
+
+BOOST_AUTO_TEST_CASE(test_nested_tasks) {
+	ThreadPool pool(3);
+	std::atomic<int> done{0};
+
+	TaskGroup group(pool);
+	for (int i = 0; i < 10; ++i)
+		group.run([&] {
+			for (int j = 0; j < 10; ++j)
+				group.run([&] { ++done; });
+		});
+	group.wait();
+
+	BOOST_CHECK_EQUAL(done.load(), 100);
+}
+
+BOOST_AUTO_TEST_CASE(test_exception_is_rethrown) {
+	ThreadPool pool(2);
+	TaskGroup group(pool);
+	group.run([] { throw std::runtime_error("task failed"); });
+	BOOST_CHECK_THROW(group.wait(), std::runtime_error);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,357 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "cancellation.h"
+#include "cpu_topology.h"
+
+/**
+ * Пул рабочих потоков с захватом работы (work stealing).
+ *
+ * Потоки создаются один раз и живут, пока жив пул, - запуск задачи не создаёт поток.
+ * У каждого потока своя очередь: задачи, поставленные из рабочего потока, попадают в его очередь
+ * и берутся с конца (самые свежие данные ещё в кеше), а простаивающие потоки забирают задачи
+ * из начала чужих очередей. Задачи извне раздаются по очередям по кругу.
+ *
+ * Потоки можно закрепить за ядрами с учётом NUMA-узлов (pin()): тогда поток сначала забирает задачи
+ * у потоков своего узла, а задачу извне можно адресовать узлу - submit( task, node ).
+ * Распределение потоков по узлам публикуется неизменяемым снимком, поэтому пул, общий для нескольких
+ * заданий, можно закрепить, пока другие задания ставят в него задачи.
+ */
+class ThreadPool
+{
+public:
+    
+    using Task = std::function< void () >;
+    
+    explicit ThreadPool( size_t threads_count )
+    {
+        if( !threads_count )
+            threads_count = 1;
+        
+        for( size_t i = 0; i < threads_count; ++i )
+            workers.push_back( std::make_unique< Worker >() );
+        
+        for( size_t i = 0; i < threads_count; ++i )
+            threads.emplace_back( &ThreadPool::worker_loop, this, i );
+    }
+    
+    ~ThreadPool()
+    {
+        {
+            std::lock_guard< std::mutex > lock( sleep_mutex );
+            stopping = true;
+        }
+        wake.notify_all();
+        
+        for( auto& th : threads )
+        {
+            if( th.joinable() )
+                th.join();
+        }
+    }
+    
+    ThreadPool( const ThreadPool& ) = delete;
+    ThreadPool& operator=( const ThreadPool& ) = delete;
+    
+    size_t size() const
+    {
+        return workers.size();
+    }
+    
+    // задач в очередях, которые ещё не взял ни один поток; 0 - кто-то из потоков может простаивать
+    size_t queued() const
+    {
+        return pending.load();
+    }
+    
+    void submit( Task task )
+    {
+        push( current_pool == this ? current_index : next_queue++ % workers.size(), std::move( task ) );
+    }
+    
+    // задача для потоков узла node (по кругу между ними); без закрепления - как submit( task )
+    void submit( Task task, int node )
+    {
+        auto nodes = std::atomic_load( &node_workers );
+        if( node < 0 || !nodes || nodes->size() < 2 )
+        {
+            submit( std::move( task ) );
+            return;
+        }
+        
+        const auto& local = ( *nodes )[ static_cast< size_t >( node ) % nodes->size() ];
+        push( local[ next_queue++ % local.size() ], std::move( task ) );
+    }
+    
+    /**
+     * Закрепляет поток i за ядром topology.place( i ): соседние потоки - на одном узле, поровну на узел.
+     * Поток больше не переезжает, поэтому память, которую задачи выделяют и заполняют в нём
+     * (буферы, арены, таблицы партиций), ядро размещает на его узле - политика first touch.
+     * Если закрепить поток не удалось (ядро запрещено cgroup), он остаётся где был.
+     * Задачи, которые ставят одновременно с этим, получают узел по старому или по новому распределению.
+     */
+    void pin( const CpuTopology& topology )
+    {
+        std::lock_guard< std::mutex > lock( pin_mutex );
+        
+        // узлы без потоков (потоков меньше, чем узлов) не нумеруем
+        std::vector< int > index( topology.nodes.size(), -1 );
+        auto nodes = std::make_shared< NodeWorkers >();
+        
+        for( size_t i = 0; i < workers.size(); ++i )
+        {
+            auto [ node, cpu ] = topology.place( i, workers.size() );
+            
+            cpu_set_t set;
+            CPU_ZERO( &set );
+            CPU_SET( cpu, &set );
+            ::pthread_setaffinity_np( threads[ i ].native_handle(), sizeof( set ), &set );
+            
+            if( index[ node ] < 0 )
+            {
+                index[ node ] = static_cast< int >( nodes->size() );
+                nodes->emplace_back();
+            }
+            ( *nodes )[ index[ node ] ].push_back( i );
+            workers[ i ]->node = index[ node ];
+        }
+        
+        std::atomic_store( &node_workers, std::shared_ptr< const NodeWorkers >( std::move( nodes ) ) );
+    }
+    
+    // снимает закрепление: потоки снова могут работать на любом разрешённом процессу ядре
+    void unpin()
+    {
+        std::lock_guard< std::mutex > lock( pin_mutex );
+        
+        cpu_set_t set;
+        CPU_ZERO( &set );
+        for( int cpu : CpuTopology::allowed_cpus() )
+            CPU_SET( cpu, &set );
+        
+        for( size_t i = 0; i < workers.size(); ++i )
+        {
+            ::pthread_setaffinity_np( threads[ i ].native_handle(), sizeof( set ), &set );
+            workers[ i ]->node = 0;
+        }
+        std::atomic_store( &node_workers, std::shared_ptr< const NodeWorkers >() );
+    }
+    
+    // узлов, между которыми распределены потоки; 1 - без закрепления
+    size_t nodes() const
+    {
+        auto nodes = std::atomic_load( &node_workers );
+        return nodes ? std::max< size_t >( nodes->size(), 1 ) : 1;
+    }
+    
+    // выполняет одну задачу из пула в текущем потоке; false - задач нет
+    bool run_pending_task()
+    {
+        Task task;
+        if( !pop_task( current_pool == this ? current_index : 0, task ) )
+            return false;
+        
+        task();
+        return true;
+    }
+    
+private:
+    using NodeWorkers = std::vector< std::vector< size_t > >;
+    
+    struct Worker
+    {
+        std::mutex mutex;
+        std::deque< Task > tasks;
+        std::atomic< int > node{ 0 };
+    };
+    
+    void push( size_t idx, Task task )
+    {
+        // счётчик увеличиваем до того, как задачу можно будет забрать, иначе он уйдёт в минус
+        {
+            std::lock_guard< std::mutex > lock( sleep_mutex );
+            ++pending;
+        }
+        
+        {
+            std::lock_guard< std::mutex > lock( workers[ idx ]->mutex );
+            workers[ idx ]->tasks.push_back( std::move( task ) );
+        }
+        wake.notify_one();
+    }
+    
+    bool pop_task( size_t idx, Task& task )
+    {
+        {
+            std::lock_guard< std::mutex > lock( workers[ idx ]->mutex );
+            if( !workers[ idx ]->tasks.empty() )
+            {
+                task = std::move( workers[ idx ]->tasks.back() );
+                workers[ idx ]->tasks.pop_back();
+                --pending;
+                return true;
+            }
+        }
+        
+        // сначала у потоков своего узла: их задачи читают память этого узла
+        int node = workers[ idx ]->node;
+        for( size_t shift = 1; shift < 2 * workers.size(); ++shift )
+        {
+            Worker& victim = *workers[ ( idx + shift ) % workers.size() ];
+            if( ( victim.node == node ) != ( shift < workers.size() ) )
+                continue;
+            
+            std::lock_guard< std::mutex > lock( victim.mutex );
+            if( !victim.tasks.empty() )
+            {
+                task = std::move( victim.tasks.front() );
+                victim.tasks.pop_front();
+                --pending;
+                return true;
+            }
+        }
+        
+        return false;
+    }
+    
+    void worker_loop( size_t idx )
+    {
+        current_pool = this;
+        current_index = idx;
+        
+        for( ;; )
+        {
+            Task task;
+            if( pop_task( idx, task ) )
+            {
+                task();
+                continue;
+            }
+            
+            std::unique_lock< std::mutex > lock( sleep_mutex );
+            wake.wait( lock, [ this ] { return stopping || pending > 0; } );
+            if( stopping && pending == 0 )
+                return;
+        }
+    }
+    
+    std::vector< std::unique_ptr< Worker > > workers;
+    std::vector< std::thread > threads;
+    std::shared_ptr< const NodeWorkers > node_workers; // потоки каждого узла после pin(); только через atomic_load/atomic_store
+    std::mutex pin_mutex; // pin() и unpin() из разных заданий - по очереди
+    
+    std::mutex sleep_mutex;
+    std::condition_variable wake;
+    std::atomic< size_t > pending{ 0 };
+    std::atomic< size_t > next_queue{ 0 };
+    bool stopping = false;
+    
+    inline static thread_local ThreadPool* current_pool = nullptr;
+    inline static thread_local size_t current_index = 0;
+};
+
+/**
+ * Группа задач в пуле, которую можно дождаться целиком.
+ * Задачи группы могут ставить в неё новые задачи.
+ * Пока wait() ждёт, вызывающий поток сам выполняет задачи из пула.
+ * Первое исключение из задач группы пробрасывается из wait().
+ * Если передан флаг отмены, исключение в любой задаче взводит его, чтобы остальные задачи не работали зря.
+ * wait( on_idle ) вместо этого только присматривает за группой: примерно раз в миллисекунду вызывает on_idle,
+ * который может, например, добавить в группу новые задачи. Занятый задачей поток не смог бы этого делать,
+ * поэтому из задачи того же пула так ждать нельзя - ждущий поток не уступит свою работу.
+ */
+class TaskGroup
+{
+public:
+    
+    explicit TaskGroup( ThreadPool& pool, CancellationToken* token = nullptr )
+    : pool( pool )
+    , token( token )
+    {}
+    
+    ~TaskGroup()
+    {
+        wait_all();
+    }
+    
+    // node - узел закреплённого пула, на котором задаче лучше выполняться (см. ThreadPool::submit), -1 - любой
+    void run( ThreadPool::Task task, int node = -1 )
+    {
+        {
+            std::lock_guard< std::mutex > lock( mutex );
+            ++active;
+        }
+        pool.submit( [ this, task = std::move( task ) ]
+        {
+            try
+            {
+                task();
+            }
+            catch( ... )
+            {
+                if( token )
+                    token->cancel();
+                
+                std::lock_guard< std::mutex > lock( mutex );
+                if( !error )
+                    error = std::current_exception();
+            }
+            
+            // уменьшаем под мьютексом: после этого ожидающий может сразу уничтожить группу
+            std::lock_guard< std::mutex > lock( mutex );
+            if( --active == 0 )
+                done.notify_all();
+        }, node );
+    }
+    
+    void wait( const std::function< void () >& on_idle = nullptr )
+    {
+        wait_all( on_idle );
+        
+        if( error )
+            std::rethrow_exception( std::exchange( error, nullptr ) );
+    }
+    
+private:
+    void wait_all( const std::function< void () >& on_idle = nullptr )
+    {
+        for( ;; )
+        {
+            {
+                std::lock_guard< std::mutex > lock( mutex );
+                if( active == 0 )
+                    return;
+            }
+            
+            if( on_idle )
+                on_idle();
+            else if( pool.run_pending_task() )
+                continue;
+            
+            // задачи группы выполняются в других потоках - ждём их, периодически проверяя пул
+            std::unique_lock< std::mutex > lock( mutex );
+            done.wait_for( lock, std::chrono::milliseconds( 1 ), [ this ] { return active == 0; } );
+        }
+    }
+    
+    ThreadPool& pool;
+    CancellationToken* token;
+    size_t active = 0;
+    std::mutex mutex;
+    std::condition_variable done;
+    std::exception_ptr error;
+};